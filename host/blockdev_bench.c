@@ -0,0 +1,315 @@
+/*
+ Run a pico_blockdev_bench workload against an image file, a RAM disk or
+ the flash translation layer on simulated NOR flash.
+
+   blockdev_bench [options] (image | -R MiB | -F MiB)
+     -m        mmap the image
+     -w        open the image read/write (needed for write workloads)
+     -s size   sector size (512)
+     -c n      stack an n-sector cache on the device
+     -C n      stack a write coalescing layer with n erase block buffers
+     -a        enable read-ahead
+     -p n      run on partition n instead of the whole device
+     -A        run on the whole device and on every partition
+     -r        random offsets
+     -M pct    percentage of reads (100)
+     -b n      sectors per request (8)
+     -q n      queue depth, 0 for the synchronous API (0)
+     -n n      number of requests (10000)
+     -t ms     time limit
+     -o n      first sector of the region
+     -S n      region size in sectors
+     -v        print the device I/O statistics after each run, then the buffer pool and object caches
+     -e bytes  flash erase block size (4096)
+     -O n      FTL reserved erase blocks (0 for the default)
+     -P        write the whole region once before the run (preconditioning)
+     -G        then let background garbage collection finish
+
+ With -F, latencies and throughput include the simulated flash time.
+ */
+#include "pico/blockdev_file.h"
+#include "pico/blockdev_ramdisk.h"
+#include "pico/blockdev_buffer.h"
+#include "pico/blockdev_cache.h"
+#include "pico/blockdev_coalesce.h"
+#include "pico/blockdev_bench.h"
+#include "pico/blockdev_ftl.h"
+#include "pico/blockdev_flash_sim.h"
+#include "pico/object_slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_DEVICES 64
+
+static pico_blockdev_flash_t *flash;
+
+uint64_t pico_blockdev_bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+
+    // The simulator does not sleep, it only accounts for the time
+    if (flash) {
+        pico_blockdev_flash_sim_stats_t st;
+        pico_blockdev_flash_sim_get_stats(flash, &st);
+        now += st.busy_ns;
+    }
+    return now;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-mwarAvPG] [-s sector_size] [-c cache_sectors] [-C buffers] [-p partition] [-M read_pct]\n"
+                    "       [-b sectors] [-q depth] [-n ios] [-t ms] [-o offset] [-S size] [-e erase_size]\n"
+                    "       [-O reserved_blocks] (image | -R MiB | -F MiB)\n", name);
+}
+
+static bool verbose;
+
+static void print_io_stats(const char *dir, const pico_blockdev_io_stats_t *io)
+{
+    printf("    %s: %lu ios, %lu merges, %llu sectors, %lu errors, %llu us\n      latency",
+           dir, (unsigned long)io->ios, (unsigned long)io->merges, (unsigned long long)io->sectors,
+           (unsigned long)io->errors, (unsigned long long)io->ticks_us);
+    for (unsigned i = 0; i < PICO_BLOCKDEV_STATS_HIST_BUCKETS; i++) {
+        if (io->latency_hist[i])
+            printf(" <%luus:%lu", 1ul << i, (unsigned long)io->latency_hist[i]);
+    }
+    printf("\n");
+}
+
+static void print_stats(pico_blockdev_t *dev)
+{
+    pico_blockdev_stats_t st;
+
+    if (pico_blockdev_ioctl(dev, PICO_IOCTL_BLKSTATS, &st) < 0)
+        return;
+    print_io_stats("read", &st.read);
+    print_io_stats("write", &st.write);
+    printf("    flushes %lu (%llu us), in flight %lu, busy %llu us\n", (unsigned long)st.flushes,
+           (unsigned long long)st.flush_ticks_us, (unsigned long)st.in_flight, (unsigned long long)st.busy_us);
+}
+
+static void print_flash_stats(pico_blockdev_t *ftl)
+{
+    pico_blockdev_ftl_stats_t st;
+    pico_blockdev_flash_sim_stats_t fs;
+
+    pico_blockdev_ftl_get_stats(ftl, &st);
+    pico_blockdev_flash_sim_get_stats(flash, &fs);
+    printf("ftl: %llu sectors written, %llu copied by gc, write amplification %.2f\n",
+           (unsigned long long)st.host_writes, (unsigned long long)st.gc_writes,
+           st.host_writes ? (double)(st.host_writes + st.gc_writes) / st.host_writes : 0.0);
+    printf("     %lu erases, %lu free blocks, erase counts %lu..%lu\n", (unsigned long)st.erases,
+           (unsigned long)st.free_blocks, (unsigned long)st.min_erase_count, (unsigned long)st.max_erase_count);
+    printf("flash: %llu KiB read, %llu pages programmed, %llu erases, %.3f s busy",
+           (unsigned long long)(fs.read_bytes >> 10), (unsigned long long)fs.programs,
+           (unsigned long long)fs.erases, fs.busy_ns / 1e9);
+    if (fs.bad_programs)
+        printf(", %llu BAD PROGRAMS", (unsigned long long)fs.bad_programs);
+    printf("\n");
+}
+
+static void precondition(pico_blockdev_t *dev, const pico_blockdev_bench_config_t *config, bool idle_gc)
+{
+    pico_blockdev_bench_config_t fill = *config;
+    pico_blockdev_bench_result_t result;
+    pico_blockdev_sector_t sectors;
+
+    if (pico_blockdev_get_sectors(dev, &sectors) < 0 || config->offset >= sectors)
+        return;
+
+    // One sequential pass over the region
+    fill.random = false;
+    fill.read_percent = 0;
+    fill.total_ios = (config->size ? config->size : sectors - config->offset) / config->block_sectors;
+    fill.duration_ms = 0;
+    if (pico_blockdev_bench_run(dev, &fill, &result) < 0 || result.errors)
+        fprintf(stderr, "preconditioning failed\n");
+
+    if (idle_gc) {
+        unsigned steps = 0;
+        while (pico_blockdev_ftl_gc_step(dev) > 0)
+            steps++;
+        printf("background gc: %u steps\n", steps);
+    }
+}
+
+static void run(const char *name, pico_blockdev_t *dev, const pico_blockdev_bench_config_t *config)
+{
+    pico_blockdev_bench_result_t result;
+
+    int r = pico_blockdev_bench_run(dev, config, &result);
+    if (r < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(-r));
+        return;
+    }
+    printf("%s: ", name);
+    pico_blockdev_bench_print(config, &result);
+    if (verbose)
+        print_stats(dev);
+}
+
+int main(int argc, char **argv)
+{
+    pico_blockdev_bench_config_t config;
+    unsigned flags = PICO_BLOCKDEV_FILE_READONLY;
+    uint32_t sector_size = 512;
+    unsigned cache_sectors = 0;
+    unsigned coalesce_buffers = 0;
+    unsigned ram_mib = 0;
+    unsigned flash_mib = 0;
+    uint32_t erase_size = 4096;
+    unsigned reserved_blocks = 0;
+    bool fill = false;
+    bool idle_gc = false;
+    int partition = -1;
+    bool readahead = false;
+    bool all = false;
+    int opt;
+
+    pico_blockdev_bench_default_config(&config);
+    config.total_ios = 10000;
+
+    while ((opt = getopt(argc, argv, "mwR:F:s:c:C:ap:ArM:b:q:n:t:o:S:ve:O:PG")) != -1) {
+        switch (opt) {
+        case 'm': flags |= PICO_BLOCKDEV_FILE_MMAP; break;
+        case 'w': flags &= ~PICO_BLOCKDEV_FILE_READONLY; break;
+        case 'R': ram_mib = strtoul(optarg, NULL, 0); break;
+        case 'F': flash_mib = strtoul(optarg, NULL, 0); break;
+        case 's': sector_size = strtoul(optarg, NULL, 0); break;
+        case 'c': cache_sectors = strtoul(optarg, NULL, 0); break;
+        case 'C': coalesce_buffers = strtoul(optarg, NULL, 0); break;
+        case 'a': readahead = true; break;
+        case 'p': partition = strtol(optarg, NULL, 0); break;
+        case 'A': all = true; break;
+        case 'r': config.random = true; break;
+        case 'M': config.read_percent = strtoul(optarg, NULL, 0); break;
+        case 'b': config.block_sectors = strtoul(optarg, NULL, 0); break;
+        case 'q': config.queue_depth = strtoul(optarg, NULL, 0); break;
+        case 'n': config.total_ios = strtoul(optarg, NULL, 0); break;
+        case 't': config.duration_ms = strtoul(optarg, NULL, 0); break;
+        case 'o': config.offset = strtoull(optarg, NULL, 0); break;
+        case 'S': config.size = strtoull(optarg, NULL, 0); break;
+        case 'v': verbose = true; break;
+        case 'e': erase_size = strtoul(optarg, NULL, 0); break;
+        case 'O': reserved_blocks = strtoul(optarg, NULL, 0); break;
+        case 'P': fill = true; break;
+        case 'G': idle_gc = true; break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    pico_blockdev_t *dev;
+    if (ram_mib) {
+        dev = pico_blockdev_ramdisk_create(NULL, (size_t)ram_mib << 20, sector_size, false);
+    } else if (flash_mib) {
+        flash = pico_blockdev_flash_sim_create(flash_mib << 20, erase_size, 256);
+        dev = flash ? pico_blockdev_ftl_create(flash, reserved_blocks) : NULL;
+        if (NULL == dev)
+            errno = EINVAL;
+    } else if (optind < argc) {
+        dev = pico_blockdev_file_create(argv[optind], sector_size, flags);
+    } else {
+        usage(argv[0]);
+        return 2;
+    }
+    if (NULL == dev) {
+        fprintf(stderr, "cannot create device: %s\n", strerror(errno));
+        return 1;
+    }
+
+    pico_blockdev_t *coalesce = NULL;
+    if (coalesce_buffers) {
+        coalesce = pico_blockdev_coalesce_create(dev, 0, coalesce_buffers, 0);
+        if (NULL == coalesce) {
+            fprintf(stderr, "cannot create write coalescing\n");
+            return 1;
+        }
+    }
+
+    pico_blockdev_t *cache = NULL;
+    if (cache_sectors) {
+        cache = pico_blockdev_cache_create(coalesce ? coalesce : dev, cache_sectors);
+        if (NULL == cache) {
+            fprintf(stderr, "cannot create cache\n");
+            return 1;
+        }
+    }
+
+    pico_blockdev_t *top = pico_blockdev_ref(cache ? cache : coalesce ? coalesce : dev);
+    pico_blockdev_register(dev);
+    if (coalesce)
+        pico_blockdev_register(coalesce);
+    if (cache)
+        pico_blockdev_register(cache);
+    if (readahead)
+        pico_blockdev_readahead_enable(dev, 0);
+
+    pico_blockdev_t *parts[MAX_DEVICES];
+    unsigned num_parts = 0;
+    for (pico_blockdev_t *d = pico_blockdev_next(NULL); d; d = pico_blockdev_next(d)) {
+        if (d->ops->map && num_parts < MAX_DEVICES)
+            parts[num_parts++] = pico_blockdev_ref(d);
+    }
+
+    if (partition >= (int)num_parts) {
+        fprintf(stderr, "no partition %d (%u found)\n", partition, num_parts);
+        return 1;
+    }
+
+    if (fill)
+        precondition(top, &config, idle_gc && flash);
+
+    if (partition < 0 || all)
+        run(pico_blockdev_get_name(top), top, &config);
+
+    for (unsigned i = 0; i < num_parts; i++) {
+        if (all || (int)i == partition) {
+            run(pico_blockdev_get_name(parts[i]), parts[i], &config);
+        }
+    }
+
+    if (cache)
+        pico_blockdev_ioctl(cache, PICO_IOCTL_BLKFLSBUF, NULL);
+    if (coalesce) {
+        pico_blockdev_coalesce_stats_t st;
+        pico_blockdev_coalesce_flush(coalesce);
+        pico_blockdev_coalesce_get_stats(coalesce, &st);
+        printf("coalesce: %lu sectors staged, %lu direct, %lu full and %lu partial flushes"
+               " (%lu sectors filled), %lu split around discards, %lu timeouts\n", (unsigned long)st.staged,
+               (unsigned long)st.direct, (unsigned long)st.full_flushes, (unsigned long)st.partial_flushes,
+               (unsigned long)st.fill_sectors, (unsigned long)st.split_flushes, (unsigned long)st.timeouts);
+    }
+    if (verbose && (all || partition >= 0)) {
+        printf("device totals:\n");
+        print_stats(dev);
+    }
+    if (flash)
+        print_flash_stats(dev);
+    if (verbose) {
+        pico_blockdev_buffer_stats_t st;
+        if (pico_blockdev_buffer_get_stats(top, &st) == 0)
+            printf("buffer pool: %u x %lu bytes, %u in use at most, %lu gets, %lu allocated on demand\n",
+                   st.total, (unsigned long)st.size, st.high_water, (unsigned long)st.gets, (unsigned long)st.misses);
+        for (pico_object_cache_t *c = pico_object_cache_next(NULL); c; c = pico_object_cache_next(c)) {
+            pico_object_slab_stats_t cs;
+            pico_object_cache_get_stats(c, &cs);
+            printf("cache %s: %u x %lu bytes, %u in use, %u at most, %lu allocs, %lu failed\n", c->name, cs.total,
+                   (unsigned long)cs.size, cs.in_use, cs.high_water, (unsigned long)cs.allocs, (unsigned long)cs.failures);
+        }
+    }
+    pico_blockdev_unref(top);
+    for (unsigned i = 0; i < num_parts; i++)
+        pico_blockdev_unref(parts[i]);
+    pico_blockdev_unregister(dev);
+    if (flash)
+        pico_blockdev_flash_sim_destroy(flash);
+    return 0;
+}
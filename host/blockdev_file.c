@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include "pico/blockdev_file.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
+
+typedef struct
+{
+    struct pico_blockdev__ dev;
+    int fd;
+    uint8_t *map;         // mmap mode only
+    uint64_t size;
+    pico_blockdev_sector_t num_sectors;
+    uint32_t sector_size;
+    unsigned flags;
+    bool blkdev;
+} pico_blockdev_file_t;
+
+static int pico_blockdev_file_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_file_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_file_readv_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                           pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_file_writev_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                            pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_file_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data);
+static void pico_blockdev_file_destroy(pico_blockdev_t *dev);
+
+static const pico_blockdev_ops_t file_ops =
+{
+    .read_sector = pico_blockdev_file_read_sector,
+    .write_sector = pico_blockdev_file_write_sector,
+    .readv_sector = pico_blockdev_file_readv_sector,
+    .writev_sector = pico_blockdev_file_writev_sector,
+    .ioctl = pico_blockdev_file_ioctl,
+    .destroy = pico_blockdev_file_destroy
+};
+
+static inline bool pico_blockdev_file_in_range(pico_blockdev_file_t *d, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    return start_sector < d->num_sectors && count <= d->num_sectors - start_sector;
+}
+
+static int pico_blockdev_file_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_file_t *d = (pico_blockdev_file_t*)dev;
+    off_t offset = (off_t)start_sector * d->sector_size;
+    size_t len = (size_t)count * d->sector_size;
+
+    if (!pico_blockdev_file_in_range(d, start_sector, count))
+        return -EINVAL;
+
+    if (d->map) {
+        memcpy(data, &d->map[offset], len);
+        return count;
+    }
+
+    while (len) {
+        ssize_t r = pread(d->fd, data, len, offset);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (r == 0)
+            return -EIO;
+        data += r;
+        offset += r;
+        len -= r;
+    }
+    return count;
+}
+
+static int pico_blockdev_file_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_file_t *d = (pico_blockdev_file_t*)dev;
+    off_t offset = (off_t)start_sector * d->sector_size;
+    size_t len = (size_t)count * d->sector_size;
+
+    if (d->flags & PICO_BLOCKDEV_FILE_READONLY)
+        return -EROFS;
+    if (!pico_blockdev_file_in_range(d, start_sector, count))
+        return -EINVAL;
+
+    if (d->map) {
+        memcpy(&d->map[offset], data, len);
+        return count;
+    }
+
+    while (len) {
+        ssize_t r = pwrite(d->fd, data, len, offset);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        data += r;
+        offset += r;
+        len -= r;
+    }
+    return count;
+}
+
+/* Segments handed to one preadv/pwritev call */
+#define FILE_IOV_BATCH 16
+
+static int pico_blockdev_file_rw_vectored(pico_blockdev_file_t *d, bool is_write, const pico_blockdev_iovec_t *iov,
+                                          unsigned iovcnt, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    off_t offset = (off_t)start_sector * d->sector_size;
+    struct iovec v[FILE_IOV_BATCH];
+    unsigned i = 0;
+    size_t skip = 0;    // Bytes of iov[i] already transferred
+
+    if (is_write && (d->flags & PICO_BLOCKDEV_FILE_READONLY))
+        return -EROFS;
+    if (!pico_blockdev_file_in_range(d, start_sector, count))
+        return -EINVAL;
+
+    if (d->map) {
+        for (i = 0; i < iovcnt; i++) {
+            size_t len = (size_t)iov[i].count * d->sector_size;
+            if (is_write)
+                memcpy(&d->map[offset], iov[i].data, len);
+            else
+                memcpy(iov[i].data, &d->map[offset], len);
+            offset += len;
+        }
+        return count;
+    }
+
+    while (i < iovcnt) {
+        unsigned n = 0;
+        for (unsigned j = i; j < iovcnt && n < FILE_IOV_BATCH; j++, n++) {
+            v[n].iov_base = (uint8_t*)iov[j].data + (j == i ? skip : 0);
+            v[n].iov_len = (size_t)iov[j].count * d->sector_size - (j == i ? skip : 0);
+        }
+
+        ssize_t r = is_write ? pwritev(d->fd, v, n, offset) : preadv(d->fd, v, n, offset);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (r == 0 && v[0].iov_len)
+            return -EIO;
+        offset += r;
+
+        // Step over what was transferred, and over empty segments
+        while (i < iovcnt) {
+            size_t left = (size_t)iov[i].count * d->sector_size - skip;
+            if ((size_t)r < left) {
+                skip += r;
+                break;
+            }
+            r -= left;
+            i++;
+            skip = 0;
+        }
+    }
+    return count;
+}
+
+static int pico_blockdev_file_readv_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                           pico_blockdev_sector_t start_sector, unsigned count)
+{
+    return pico_blockdev_file_rw_vectored((pico_blockdev_file_t*)dev, false, iov, iovcnt, start_sector, count);
+}
+
+static int pico_blockdev_file_writev_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                            pico_blockdev_sector_t start_sector, unsigned count)
+{
+    return pico_blockdev_file_rw_vectored((pico_blockdev_file_t*)dev, true, iov, iovcnt, start_sector, count);
+}
+
+static int pico_blockdev_file_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data)
+{
+    pico_blockdev_file_t *d = (pico_blockdev_file_t*)dev;
+
+    switch (cmd)
+    {
+    case PICO_IOCTL_BLKGETSIZE:
+        if (d->num_sectors > UINT32_MAX)
+            return -EFBIG;
+        *(uint32_t*)data = d->num_sectors;
+        return 0;
+    case PICO_IOCTL_BLKGETSIZE64:
+        *(uint64_t*)data = (uint64_t)d->num_sectors * d->sector_size;
+        return 0;
+    case PICO_IOCTL_BLKROGET:
+        *(int*)data = !!(d->flags & PICO_BLOCKDEV_FILE_READONLY);
+        return 0;
+    case PICO_IOCTL_BLKFLSBUF:
+        if (d->map ? msync(d->map, d->size, MS_SYNC) : fsync(d->fd))
+            return -errno;
+        return 0;
+    case PICO_IOCTL_BLKDIRECT: {
+        pico_blockdev_direct_t *direct = (pico_blockdev_direct_t*)data;
+        if (!d->map)
+            return -ENOTSUP;
+        if (!pico_blockdev_file_in_range(d, direct->sector, direct->count))
+            return -EINVAL;
+        direct->addr = &d->map[(size_t)direct->sector * d->sector_size];
+        return 0;
+    }
+    case PICO_IOCTL_BLKDISCARD: {
+        pico_blockdev_range_t *range = (pico_blockdev_range_t*)data;
+        uint64_t span[2] = { (uint64_t)range->sector * d->sector_size, (uint64_t)range->count * d->sector_size };
+        if (d->flags & PICO_BLOCKDEV_FILE_READONLY)
+            return -EROFS;
+        if (!pico_blockdev_file_in_range(d, range->sector, range->count))
+            return -EINVAL;
+        // Pass it on to the disk, or give the blocks back to the filesystem
+        if (d->blkdev ? ioctl(d->fd, BLKDISCARD, span) :
+                        fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, span[0], span[1]))
+            return errno == EOPNOTSUPP ? -ENOTSUP : -errno;
+        return 0;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+static void pico_blockdev_file_destroy(pico_blockdev_t *dev)
+{
+    pico_blockdev_file_t *d = (pico_blockdev_file_t*)dev;
+
+    if (d->map)
+        munmap(d->map, d->size);
+    close(d->fd);
+    free(d);
+}
+
+pico_blockdev_t *pico_blockdev_file_create(const char *path, uint32_t sector_size, unsigned flags)
+{
+    bool readonly = flags & PICO_BLOCKDEV_FILE_READONLY;
+    struct stat st;
+
+    if (sector_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pico_blockdev_file_t *d = calloc(1, sizeof(pico_blockdev_file_t));
+    if (NULL == d)
+        return NULL;
+
+    d->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+    if (d->fd < 0)
+        goto err_free;
+
+    if (fstat(d->fd, &st) < 0)
+        goto err_close;
+
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(d->fd, BLKGETSIZE64, &d->size) < 0)
+            goto err_close;
+        d->blkdev = true;
+    } else {
+        d->size = st.st_size;
+    }
+
+    d->num_sectors = d->size / sector_size;
+    if (d->num_sectors == 0 || d->size / sector_size > PICO_BLOCKDEV_SECTOR_MAX) {
+        errno = d->num_sectors ? EFBIG : EINVAL;
+        goto err_close;
+    }
+    d->sector_size = sector_size;
+    d->flags = flags;
+
+    if (flags & PICO_BLOCKDEV_FILE_MMAP) {
+        void *map = mmap(NULL, d->size, readonly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+        if (map == MAP_FAILED)
+            goto err_close;
+        d->map = map;
+    }
+
+    pico_blockdev_init(&d->dev, &file_ops);
+    pico_blockdev_set_name(&d->dev, "file");
+    pico_blockdev_set_sector_size(&d->dev, sector_size);
+
+    return &d->dev;
+
+err_close:
+    {
+        int e = errno;
+        close(d->fd);
+        errno = e;
+    }
+err_free:
+    free(d);
+    return NULL;
+}
@@ -0,0 +1,160 @@
+/*
+ Register an image with the block layer and list the devices found, as a
+ tree with their sizes and I/O counts. With -r every partition is read
+ end to end, to profile the stack. With -l the partition scan is deferred
+ and timed apart from registration. Built with PICO_OBJECT_TRACK, the
+ objects left once the image is unregistered are listed by type.
+
+   blockdev_scan [-m] [-s sector_size] [-c cache_sectors] [-a] [-r] [-l] image
+ */
+#include "pico/blockdev_file.h"
+#include "pico/blockdev_cache.h"
+#include "pico/time.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define READ_CHUNK (128 * 1024)
+
+static void read_all(pico_blockdev_t *dev, uint32_t sector_size, pico_blockdev_sector_t sectors)
+{
+    unsigned chunk = READ_CHUNK / sector_size;
+    uint8_t *buf = malloc(READ_CHUNK);
+    uint64_t start = time_us_64();
+
+    for (pico_blockdev_sector_t s = 0; s < sectors; s += chunk) {
+        unsigned n = MIN(chunk, sectors - s);
+        int r = pico_blockdev_read_sector(dev, buf, s, n);
+        if (r != (int)n) {
+            printf("    read error %d at sector %llu\n", r, (unsigned long long)s);
+            break;
+        }
+    }
+
+    uint64_t us = time_us_64() - start;
+    printf("    read %llu KiB in %llu us, %.1f MiB/s\n",
+           (unsigned long long)(sectors * sector_size >> 10), (unsigned long long)us,
+           us ? (double)sectors * sector_size / us * 1e6 / (1 << 20) : 0.0);
+    free(buf);
+}
+
+static void print_tree(pico_blockdev_t *dev, unsigned depth)
+{
+    pico_blockdev_sector_t sectors = 0;
+    pico_blockdev_stats_t st;
+    uint32_t ssz = pico_blockdev_get_sector_size(dev);
+
+    pico_blockdev_get_sectors(dev, &sectors);
+    uint64_t bytes = (uint64_t)sectors * ssz;
+    if (bytes < (1 << 20))
+        printf("%*s%-*s %10.1f KiB", depth * 2, "", 16 - depth * 2, pico_blockdev_get_name(dev), bytes / 1024.0);
+    else
+        printf("%*s%-*s %10.1f MiB", depth * 2, "", 16 - depth * 2, pico_blockdev_get_name(dev),
+               bytes / (1024.0 * 1024.0));
+    printf(" %6lu", (unsigned long)ssz);
+    if (pico_blockdev_ioctl(dev, PICO_IOCTL_BLKSTATS, &st) == 0)
+        printf(" %8lu %8lu", (unsigned long)st.read.ios, (unsigned long)st.write.ios);
+    printf("\n");
+
+    for (pico_blockdev_t *child = pico_blockdev_next_child(dev, NULL); child;
+         child = pico_blockdev_next_child(dev, child))
+        print_tree(child, depth + 1);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned flags = PICO_BLOCKDEV_FILE_READONLY;
+    uint32_t sector_size = 512;
+    unsigned cache_sectors = 0;
+    bool readahead = false;
+    bool read = false;
+    bool lazy = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ms:c:arl")) != -1) {
+        switch (opt) {
+        case 'm': flags |= PICO_BLOCKDEV_FILE_MMAP; break;
+        case 's': sector_size = strtoul(optarg, NULL, 0); break;
+        case 'c': cache_sectors = strtoul(optarg, NULL, 0); break;
+        case 'a': readahead = true; break;
+        case 'r': read = true; break;
+        case 'l': lazy = true; break;
+        default:
+            fprintf(stderr, "usage: %s [-m] [-s sector_size] [-c cache_sectors] [-a] [-r] [-l] image\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "missing image\n");
+        return 2;
+    }
+
+    pico_blockdev_t *dev = pico_blockdev_file_create(argv[optind], sector_size, flags);
+    if (NULL == dev) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    pico_blockdev_t *cache = NULL;
+    if (cache_sectors) {
+        cache = pico_blockdev_cache_create(dev, cache_sectors);
+        if (NULL == cache) {
+            fprintf(stderr, "cannot create cache\n");
+            return 1;
+        }
+    }
+
+    uint64_t start = time_us_64();
+    if (lazy) {
+        pico_blockdev_register_deferred(dev);
+        if (cache)
+            pico_blockdev_register_deferred(cache);
+        printf("register took %llu us\n", (unsigned long long)(time_us_64() - start));
+        // As a worker would once boot is done
+        start = time_us_64();
+        while (pico_blockdev_scan_pending())
+            ;
+    } else {
+        pico_blockdev_register(dev);
+        if (cache)
+            pico_blockdev_register(cache);
+    }
+    printf("scan took %llu us\n", (unsigned long long)(time_us_64() - start));
+
+    if (readahead)
+        pico_blockdev_readahead_enable(dev, 0);
+
+    // Read every partition, or the whole device if there are none
+    if (read) {
+        pico_blockdev_t *top = cache ? cache : dev;
+        bool found = false;
+        for (pico_blockdev_t *d = pico_blockdev_next(NULL); d; d = pico_blockdev_next(d)) {
+            if (d->ops->map) {
+                pico_blockdev_sector_t sectors = 0;
+                pico_blockdev_get_sectors(d, &sectors);
+                printf("%s:\n", pico_blockdev_get_name(d));
+                read_all(d, pico_blockdev_get_sector_size(d), sectors);
+                found = true;
+            }
+        }
+        if (!found) {
+            pico_blockdev_sector_t sectors = 0;
+            pico_blockdev_get_sectors(top, &sectors);
+            printf("%s:\n", pico_blockdev_get_name(top));
+            read_all(top, pico_blockdev_get_sector_size(top), sectors);
+        }
+    }
+
+    printf("%-16s %14s %6s %8s %8s\n", "NAME", "SIZE", "SECTOR", "READS", "WRITES");
+    for (pico_blockdev_t *d = pico_blockdev_next(NULL); d; d = pico_blockdev_next(d)) {
+        if (NULL == d->parent)
+            print_tree(d, 0);
+    }
+
+    pico_blockdev_unregister(dev);
+#if PICO_OBJECT_TRACK
+    pico_object_census_print();
+#endif
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include "pico/blockdev_flash_sim.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct
+{
+    pico_blockdev_flash_t flash;
+    uint8_t *mem;
+    uint32_t *erase_counts;
+    pico_blockdev_flash_sim_timing_t timing;
+    pico_blockdev_flash_sim_stats_t stats;
+} pico_blockdev_flash_sim_t;
+
+static int pico_blockdev_flash_sim_read(pico_blockdev_flash_t *flash, uint32_t offset, void *data, uint32_t len)
+{
+    pico_blockdev_flash_sim_t *f = (pico_blockdev_flash_sim_t*)flash;
+
+    if (offset > flash->size || len > flash->size - offset)
+        return -EINVAL;
+
+    memcpy(data, &f->mem[offset], len);
+    f->stats.reads++;
+    f->stats.read_bytes += len;
+    f->stats.busy_ns += (uint64_t)len * f->timing.read_ns_per_byte;
+    return 0;
+}
+
+static int pico_blockdev_flash_sim_program(pico_blockdev_flash_t *flash, uint32_t offset, const void *data, uint32_t len)
+{
+    pico_blockdev_flash_sim_t *f = (pico_blockdev_flash_sim_t*)flash;
+    const uint8_t *src = (const uint8_t*)data;
+
+    if (offset > flash->size || len > flash->size - offset || ((offset | len) & (flash->program_size - 1)))
+        return -EINVAL;
+
+    for (uint32_t i = 0; i < len; i++) {
+        // 0xFF leaves a byte alone, anything else is meant to land as is
+        if (src[i] != 0xFF && (src[i] & ~f->mem[offset + i]))
+            f->stats.bad_programs++;
+        f->mem[offset + i] &= src[i];
+    }
+    f->stats.programs += len / flash->program_size;
+    f->stats.busy_ns += (uint64_t)(len / flash->program_size) * f->timing.program_us * 1000;
+    return 0;
+}
+
+static int pico_blockdev_flash_sim_erase(pico_blockdev_flash_t *flash, uint32_t offset)
+{
+    pico_blockdev_flash_sim_t *f = (pico_blockdev_flash_sim_t*)flash;
+
+    if (offset >= flash->size || (offset & (flash->erase_size - 1)))
+        return -EINVAL;
+
+    memset(&f->mem[offset], 0xFF, flash->erase_size);
+    f->erase_counts[offset / flash->erase_size]++;
+    f->stats.erases++;
+    f->stats.busy_ns += (uint64_t)f->timing.erase_us * 1000;
+    return 0;
+}
+
+static const pico_blockdev_flash_ops_t flash_sim_ops =
+{
+    .read = pico_blockdev_flash_sim_read,
+    .program = pico_blockdev_flash_sim_program,
+    .erase = pico_blockdev_flash_sim_erase
+};
+
+pico_blockdev_flash_t *pico_blockdev_flash_sim_create(uint32_t size, uint32_t erase_size, uint32_t program_size)
+{
+    if (erase_size == 0 || (erase_size & (erase_size - 1)) || program_size == 0 ||
+        (program_size & (program_size - 1)) || program_size > erase_size || size < erase_size || size % erase_size)
+        return NULL;
+
+    pico_blockdev_flash_sim_t *f = calloc(1, sizeof(pico_blockdev_flash_sim_t));
+    if (NULL == f)
+        return NULL;
+
+    f->mem = malloc(size);
+    f->erase_counts = calloc(size / erase_size, sizeof(uint32_t));
+    if (!f->mem || !f->erase_counts) {
+        free(f->erase_counts);
+        free(f->mem);
+        free(f);
+        return NULL;
+    }
+    memset(f->mem, 0xFF, size);
+
+    f->flash.ops = &flash_sim_ops;
+    f->flash.size = size;
+    f->flash.erase_size = erase_size;
+    f->flash.program_size = program_size;
+    f->timing.read_ns_per_byte = 20;
+    f->timing.program_us = 400;
+    f->timing.erase_us = 45000;
+
+    return &f->flash;
+}
+
+void pico_blockdev_flash_sim_set_timing(pico_blockdev_flash_t *flash, const pico_blockdev_flash_sim_timing_t *timing)
+{
+    ((pico_blockdev_flash_sim_t*)flash)->timing = *timing;
+}
+
+void pico_blockdev_flash_sim_get_stats(pico_blockdev_flash_t *flash, pico_blockdev_flash_sim_stats_t *stats)
+{
+    pico_blockdev_flash_sim_t *f = (pico_blockdev_flash_sim_t*)flash;
+
+    *stats = f->stats;
+    stats->min_erase_count = UINT32_MAX;
+    stats->max_erase_count = 0;
+    for (uint32_t i = 0; i < flash->size / flash->erase_size; i++) {
+        if (f->erase_counts[i] < stats->min_erase_count)
+            stats->min_erase_count = f->erase_counts[i];
+        if (f->erase_counts[i] > stats->max_erase_count)
+            stats->max_erase_count = f->erase_counts[i];
+    }
+}
+
+void pico_blockdev_flash_sim_destroy(pico_blockdev_flash_t *flash)
+{
+    pico_blockdev_flash_sim_t *f = (pico_blockdev_flash_sim_t*)flash;
+
+    free(f->erase_counts);
+    free(f->mem);
+    free(f);
+}
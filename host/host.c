@@ -0,0 +1,7 @@
+#include "pico/vfs.h"
+
+/* The VFS passes newlib's reentrancy structure around; errno is used instead on the host */
+struct _reent *__getreent(void)
+{
+    return NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef _HOST_PICO_H
+#define _HOST_PICO_H
+
+/*
+ Minimal stand-in for the Pico SDK base header, enough to build the
+ libraries in this repository natively on Linux.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "pico/platform.h"
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef BLOCKDEV_FILE_H__
+#define BLOCKDEV_FILE_H__
+
+#include "pico/blockdev.h"
+
+/*
+ Host block device backed by an image file or a Linux block device.
+
+ By default I/O goes through pread/pwrite. In mmap mode the image is
+ mapped and I/O is a memcpy, and the device answers PICO_IOCTL_BLKDIRECT.
+ Discard punches a hole in image files and is passed on to block devices.
+ */
+
+#define PICO_BLOCKDEV_FILE_READONLY (1<<0)
+#define PICO_BLOCKDEV_FILE_MMAP (1<<1)
+
+/* Returns a new device over the file at path, or NULL with errno set */
+pico_blockdev_t *pico_blockdev_file_create(const char *path, uint32_t sector_size, unsigned flags);
+
+#endif
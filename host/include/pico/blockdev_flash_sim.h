@@ -0,0 +1,45 @@
+#ifndef BLOCKDEV_FLASH_SIM_H__
+#define BLOCKDEV_FLASH_SIM_H__
+
+#include "pico/blockdev_ftl.h"
+
+/*
+ NOR flash simulator for running the FTL on the host. Contents live in
+ memory and start erased. Programming can only clear bits, as on the real
+ part. Bytes other than 0xFF that do not come out as programmed are counted
+ as bad programs, which points at a missing erase.
+
+ No time passes during operations. Instead, each one adds its cost from
+ the timing table to busy_ns, which benchmarks can add to their clock.
+ */
+
+typedef struct
+{
+    uint32_t read_ns_per_byte;
+    uint32_t program_us;           // Per program page
+    uint32_t erase_us;             // Per erase block
+} pico_blockdev_flash_sim_timing_t;
+
+typedef struct
+{
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t programs;             // Program pages
+    uint64_t erases;
+    uint64_t bad_programs;         // Bytes that needed a bit set
+    uint32_t min_erase_count;
+    uint32_t max_erase_count;
+    uint64_t busy_ns;
+} pico_blockdev_flash_sim_stats_t;
+
+/*
+ Returns a simulated part, or NULL. Timing defaults to typical figures for
+ a W25Q16JV on the RP2040: 20 ns per byte read, 400 us per page program,
+ 45 ms per 4K erase.
+ */
+pico_blockdev_flash_t *pico_blockdev_flash_sim_create(uint32_t size, uint32_t erase_size, uint32_t program_size);
+void pico_blockdev_flash_sim_set_timing(pico_blockdev_flash_t *flash, const pico_blockdev_flash_sim_timing_t *timing);
+void pico_blockdev_flash_sim_get_stats(pico_blockdev_flash_t *flash, pico_blockdev_flash_sim_stats_t *stats);
+void pico_blockdev_flash_sim_destroy(pico_blockdev_flash_t *flash);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef _HOST_PICO_PLATFORM_H
+#define _HOST_PICO_PLATFORM_H
+
+#ifndef MIN
+#define MIN(a, b) ((b) < (a) ? (b) : (a))
+#endif
+
+#ifndef MAX
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+#endif
+
+#define __not_in_flash_func(func_name) func_name
+#define __time_critical_func(func_name) func_name
+#define __no_inline_not_in_flash_func(func_name) __attribute__((noinline)) func_name
+
+static inline void tight_loop_contents(void)
+{
+}
+
+/* Host threads are not pinned, everything runs as core 0 */
+static inline unsigned int get_core_num(void)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _HOST_PICO_SYNC_H
+#define _HOST_PICO_SYNC_H
+
+/*
+ Pico SDK synchronisation primitives on top of pthreads. Critical
+ sections become plain mutexes: there are no interrupts to mask, and
+ "IRQ" callbacks (e.g. driver completions) run on ordinary threads.
+ */
+
+#include "pico.h"
+#include <pthread.h>
+
+/* Lock owners are threads rather than cores */
+typedef uintptr_t lock_owner_id_t;
+#define LOCK_INVALID_OWNER_ID ((lock_owner_id_t)0)
+
+static inline lock_owner_id_t lock_get_caller_owner_id(void)
+{
+    return (lock_owner_id_t)pthread_self();
+}
+
+typedef struct
+{
+    pthread_mutex_t lock;
+} critical_section_t;
+
+static inline void critical_section_init(critical_section_t *crit_sec)
+{
+    pthread_mutex_init(&crit_sec->lock, NULL);
+}
+
+static inline void critical_section_init_with_lock_num(critical_section_t *crit_sec, unsigned int lock_num)
+{
+    (void)lock_num;
+    critical_section_init(crit_sec);
+}
+
+static inline void critical_section_enter_blocking(critical_section_t *crit_sec)
+{
+    pthread_mutex_lock(&crit_sec->lock);
+}
+
+static inline void critical_section_exit(critical_section_t *crit_sec)
+{
+    pthread_mutex_unlock(&crit_sec->lock);
+}
+
+static inline void critical_section_deinit(critical_section_t *crit_sec)
+{
+    pthread_mutex_destroy(&crit_sec->lock);
+}
+
+typedef struct
+{
+    pthread_mutex_t lock;
+} mutex_t;
+
+static inline void mutex_init(mutex_t *mtx)
+{
+    pthread_mutex_init(&mtx->lock, NULL);
+}
+
+static inline void mutex_enter_blocking(mutex_t *mtx)
+{
+    pthread_mutex_lock(&mtx->lock);
+}
+
+static inline bool mutex_try_enter(mutex_t *mtx, uint32_t *owner_out)
+{
+    (void)owner_out;
+    return pthread_mutex_trylock(&mtx->lock) == 0;
+}
+
+static inline void mutex_exit(mutex_t *mtx)
+{
+    pthread_mutex_unlock(&mtx->lock);
+}
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int16_t permits;
+    int16_t max_permits;
+} semaphore_t;
+
+static inline void sem_init(semaphore_t *sem, int16_t initial_permits, int16_t max_permits)
+{
+    pthread_mutex_init(&sem->lock, NULL);
+    pthread_cond_init(&sem->cond, NULL);
+    sem->permits = initial_permits;
+    sem->max_permits = max_permits;
+}
+
+static inline int sem_available(semaphore_t *sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    int permits = sem->permits;
+    pthread_mutex_unlock(&sem->lock);
+    return permits;
+}
+
+static inline bool sem_release(semaphore_t *sem)
+{
+    bool released = false;
+
+    pthread_mutex_lock(&sem->lock);
+    if (sem->permits < sem->max_permits) {
+        sem->permits++;
+        released = true;
+        pthread_cond_signal(&sem->cond);
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return released;
+}
+
+static inline void sem_reset(semaphore_t *sem, int16_t permits)
+{
+    pthread_mutex_lock(&sem->lock);
+    sem->permits = permits;
+    if (permits > 0)
+        pthread_cond_broadcast(&sem->cond);
+    pthread_mutex_unlock(&sem->lock);
+}
+
+static inline void sem_acquire_blocking(semaphore_t *sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    while (sem->permits <= 0)
+        pthread_cond_wait(&sem->cond, &sem->lock);
+    sem->permits--;
+    pthread_mutex_unlock(&sem->lock);
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef _HOST_PICO_TIME_H
+#define _HOST_PICO_TIME_H
+
+#include "pico.h"
+#include <time.h>
+
+static inline uint64_t time_us_64(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static inline uint32_t time_us_32(void)
+{
+    return (uint32_t)time_us_64();
+}
+
+static inline void sleep_us(uint64_t us)
+{
+    struct timespec ts = { .tv_sec = us / 1000000u, .tv_nsec = (us % 1000000u) * 1000 };
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
+
+static inline void sleep_ms(uint32_t ms)
+{
+    sleep_us((uint64_t)ms * 1000);
+}
+
+static inline void busy_wait_us(uint64_t us)
+{
+    uint64_t end = time_us_64() + us;
+    while (time_us_64() < end)
+        tight_loop_contents();
+}
+
+#endif
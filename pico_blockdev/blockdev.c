@@ -1,51 +1,399 @@
 #include "pico/blockdev.h"
+#include "pico/blockdev_buffer.h"
+#include "pico/object_slab.h"
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <sys/errno.h>
+#include <pico/sync.h>
+#include <pico/time.h>
 
 extern void pico_blockdev_scan_partitions(pico_blockdev_t *dev);
+extern int pico_blockdev_queue_submit(pico_blockdev_t *dev, pico_blockdev_request_t *req, uint8_t flags);
+extern void pico_blockdev_queue_setup(pico_blockdev_t *dev);
+extern void pico_blockdev_queue_release(pico_blockdev_t *dev);
+extern int pico_blockdev_map(pico_blockdev_t **dev, pico_blockdev_sector_t *sector, unsigned *count);
+extern void pico_blockdev_map_flatten(pico_blockdev_t *dev);
+extern int pico_blockdev_readahead_read(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+extern int pico_blockdev_readahead_stats(pico_blockdev_t *dev, pico_blockdev_readahead_stats_t *stats);
+extern int pico_blockdev_stats_get(pico_blockdev_t *dev, pico_blockdev_stats_t *stats);
+extern void pico_blockdev_stats_flush(pico_blockdev_t *dev, uint32_t ticks_us);
+extern void pico_blockdev_stats_account(pico_blockdev_t *dev, pico_blockdev_t *origin, bool is_write, int sectors, uint32_t submitted);
+extern void pico_blockdev_registry_add(pico_blockdev_t *dev, bool scan_pending);
+extern bool pico_blockdev_registry_remove(pico_blockdev_t *dev);
+extern void pico_blockdev_registry_release(pico_blockdev_t *dev);
+extern void pico_blockdev_readahead_invalidate_locked(pico_blockdev_t *dev, pico_blockdev_sector_t start_sector, unsigned count);
+
+PICO_OBJECT_CACHE_DEFINE(link_cache, struct pico_blockdev_link_entry, PICO_BLOCKDEV_STATIC_LINKS);
 
 static void pico_blockdev_destroy_object(pico_object_t *obj)
 {
     pico_blockdev_t *dev = (pico_blockdev_t*)obj;
     // Called after unref.
+    if (dev) {
+        if (dev->readahead)
+            pico_blockdev_readahead_disable(dev);
+        pico_blockdev_queue_release(dev);
+        pico_blockdev_registry_release(dev);
+    }
     if (dev && dev->ops && dev->ops->destroy) {
         dev->ops->destroy(dev);
     }
 }
 
-int pico_blockdev_read_sector(pico_blockdev_t *dev, unsigned char* data, uint32_t start_sector, unsigned count)
+int pico_blockdev_read_sector_async(pico_blockdev_t *dev, pico_blockdev_request_t *req,
+                                    unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count,
+                                    pico_blockdev_completion_t completion, void *user)
 {
-    if (dev->ops->read_sector) {
-        return (*dev->ops->read_sector)(dev, data, start_sector, count);
-    } else {
-        return -ENOSYS;
-    }
+    req->is_write = false;
+    req->read_data = data;
+    req->start_sector = start_sector;
+    req->sector_count = count;
+    req->completion = completion;
+    req->completion_user = user;
+    return pico_blockdev_submit(dev, req);
 }
 
-int pico_blockdev_write_sector(pico_blockdev_t *dev, const unsigned char* data, uint32_t start_sector, unsigned count)
+int pico_blockdev_write_sector_async(pico_blockdev_t *dev, pico_blockdev_request_t *req,
+                                     const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count,
+                                     pico_blockdev_completion_t completion, void *user)
 {
-    if (dev->ops->write_sector) {
-        return (*dev->ops->write_sector)(dev, data, start_sector, count);
-    } else {
-        return -ENOSYS;
+    req->is_write = true;
+    req->write_data = data;
+    req->start_sector = start_sector;
+    req->sector_count = count;
+    req->completion = completion;
+    req->completion_user = user;
+    return pico_blockdev_submit(dev, req);
+}
+
+static void pico_blockdev_sync_completion(void *user, pico_blockdev_request_t *req)
+{
+    sem_release((semaphore_t*)user);
+}
+
+/* Synchronous read bypassing read-ahead */
+int pico_blockdev_read_sync(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_request_t req;
+    semaphore_t done;
+
+    sem_init(&done, 0, 1);
+
+    req.is_write = false;
+    req.read_data = data;
+    req.start_sector = start_sector;
+    req.sector_count = count;
+    req.completion = &pico_blockdev_sync_completion;
+    req.completion_user = &done;
+
+    int r = pico_blockdev_queue_submit(dev, &req, PICO_BLOCKDEV_REQ_SYNC);
+    if (r < 0)
+        return r;
+
+    sem_acquire_blocking(&done);
+    return req.status;
+}
+
+int pico_blockdev_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_t *target = dev;
+    pico_blockdev_sector_t sector = start_sector;
+    unsigned sectors = count;
+
+    int shift = pico_blockdev_map(&target, &sector, &sectors);
+    if (shift < 0)
+        return shift;
+
+    // Submitted unmapped, so that a partition counts its own reads
+    if (NULL == target->readahead)
+        return pico_blockdev_read_sync(dev, data, start_sector, count);
+
+    uint32_t submitted = time_us_32();
+    int r = pico_blockdev_readahead_read(target, data, sector, sectors);
+    if (r > 0)
+        r >>= shift;
+    // The target counts only what reached the device, the partition every read
+    if (target != dev)
+        pico_blockdev_stats_account(target, dev, false, r, submitted);
+    return r;
+}
+
+int pico_blockdev_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_request_t req;
+    semaphore_t done;
+
+    sem_init(&done, 0, 1);
+
+    req.is_write = true;
+    req.write_data = data;
+    req.start_sector = start_sector;
+    req.sector_count = count;
+    req.completion = &pico_blockdev_sync_completion;
+    req.completion_user = &done;
+
+    int r = pico_blockdev_queue_submit(dev, &req, PICO_BLOCKDEV_REQ_SYNC);
+    if (r < 0)
+        return r;
+
+    sem_acquire_blocking(&done);
+    return req.status;
+}
+
+static bool pico_blockdev_vectored(const pico_blockdev_t *dev, bool is_write)
+{
+    if (dev->ops->request)
+        return dev->ops->request_vectored;
+    return is_write ? dev->ops->writev_sector != NULL : dev->ops->readv_sector != NULL;
+}
+
+static int pico_blockdev_rw_vectored(pico_blockdev_t *dev, bool is_write, const pico_blockdev_iovec_t *iov,
+                                     unsigned iovcnt, pico_blockdev_sector_t start_sector)
+{
+    pico_blockdev_t *owner = dev;
+    pico_blockdev_sector_t sector = start_sector;
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < iovcnt; i++) {
+        if (iov[i].count > UINT_MAX - count)
+            return -EINVAL;
+        count += iov[i].count;
+    }
+    if (count == 0)
+        return 0;
+
+    int shift = pico_blockdev_map(&owner, &sector, &count);
+    if (shift < 0)
+        return shift;
+
+    // Segment counts are in our sectors, so layers with larger sectors than
+    // the driver's split; so do reads that read-ahead may serve.
+    if (iovcnt > 1 && shift == 0 && pico_blockdev_vectored(owner, is_write) && (is_write || !owner->readahead)) {
+        pico_blockdev_request_t req;
+        semaphore_t done;
+
+        sem_init(&done, 0, 1);
+
+        req.is_write = is_write;
+        req.iov = iov;
+        req.iovcnt = iovcnt;
+        req.start_sector = start_sector;
+        req.sector_count = count;
+        req.completion = &pico_blockdev_sync_completion;
+        req.completion_user = &done;
+
+        int r = pico_blockdev_queue_submit(dev, &req, PICO_BLOCKDEV_REQ_SYNC | PICO_BLOCKDEV_REQ_VECTORED);
+        if (r < 0)
+            return r;
+
+        sem_acquire_blocking(&done);
+        return req.status;
+    }
+
+    int done = 0;
+    for (unsigned i = 0; i < iovcnt; i++) {
+        if (iov[i].count == 0)
+            continue;
+        int r = is_write ? pico_blockdev_write_sector(dev, iov[i].data, start_sector, iov[i].count)
+                         : pico_blockdev_read_sector(dev, iov[i].data, start_sector, iov[i].count);
+        if (r < 0)
+            return r;
+        done += r;
+        start_sector += r;
+        if ((unsigned)r != iov[i].count)
+            break;
     }
+    return done;
+}
+
+int pico_blockdev_readv_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                               pico_blockdev_sector_t start_sector)
+{
+    return pico_blockdev_rw_vectored(dev, false, iov, iovcnt, start_sector);
+}
+
+int pico_blockdev_writev_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                pico_blockdev_sector_t start_sector)
+{
+    return pico_blockdev_rw_vectored(dev, true, iov, iovcnt, start_sector);
 }
 
 int pico_blockdev_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data)
 {
-    if (dev->ops->ioctl) {
-        return (*dev->ops->ioctl)(dev, cmd, data);
-    } else {
+    // Handled by the block layer itself
+    if (cmd == PICO_IOCTL_BLKRASTAT) {
+        return pico_blockdev_readahead_stats(dev, (pico_blockdev_readahead_stats_t*)data);
+    }
+    if (cmd == PICO_IOCTL_BLKSSZGET) {
+        *(uint32_t*)data = pico_blockdev_get_sector_size(dev);
+        return 0;
+    }
+    if (cmd == PICO_IOCTL_BLKSTATS) {
+        return pico_blockdev_stats_get(dev, (pico_blockdev_stats_t*)data);
+    }
+    if (cmd == PICO_IOCTL_BLKDISCARD) {
+        pico_blockdev_range_t *range = (pico_blockdev_range_t*)data;
+        return pico_blockdev_discard(dev, range->sector, range->count);
+    }
+
+    if (!dev->ops->ioctl)
         return -ENOSYS;
+
+    if (cmd == PICO_IOCTL_BLKFLSBUF) {
+        uint32_t start = time_us_32();
+        int r = (*dev->ops->ioctl)(dev, cmd, data);
+        pico_blockdev_stats_flush(dev, time_us_32() - start);
+        return r;
+    }
+    return (*dev->ops->ioctl)(dev, cmd, data);
+}
+
+uint32_t pico_blockdev_get_sector_size(pico_blockdev_t *dev)
+{
+    uint32_t sector_size = dev->sector_size;
+
+    if (sector_size == 0) {
+        // Ask the driver directly, the block layer answers BLKSSZGET from here
+        if (!dev->ops->ioctl || dev->ops->ioctl(dev, PICO_IOCTL_BLKSSZGET, &sector_size) < 0 || sector_size == 0)
+            sector_size = (dev->ops->map && dev->parent) ? pico_blockdev_get_sector_size(dev->parent) : 512;
+        dev->sector_size = sector_size;
+    }
+    return sector_size;
+}
+
+/* Recompute the flattened translation of dev and of the remapping layers above it */
+static void pico_blockdev_reflatten(pico_blockdev_t *dev)
+{
+    pico_blockdev_map_flatten(dev);
+    for (struct pico_blockdev_link_entry *link = dev->children; link; link = link->next) {
+        if (link->dev->ops->map)
+            pico_blockdev_reflatten(link->dev);
+    }
+}
+
+int pico_blockdev_set_sector_size(pico_blockdev_t *dev, uint32_t sector_size)
+{
+    uint8_t shift = 0;
+
+    if (sector_size == 0)
+        return -EINVAL;
+
+    if (dev->ops->map) {
+        if (NULL == dev->parent)
+            return -EINVAL;
+        uint32_t parent_size = pico_blockdev_get_sector_size(dev->parent);
+        while ((parent_size << shift) < sector_size && shift < 16)
+            shift++;
+        if ((parent_size << shift) != sector_size)
+            return -EINVAL;
+    }
+
+    pico_object_lock(&dev->obj);
+    dev->sector_size = sector_size;
+    dev->sector_shift = shift;
+    pico_object_unlock(&dev->obj);
+
+    if (dev->ops->map)
+        pico_blockdev_reflatten(dev);
+    return 0;
+}
+
+int pico_blockdev_get_sectors(pico_blockdev_t *dev, pico_blockdev_sector_t *sectors)
+{
+    uint64_t bytes;
+    uint32_t sector_size = pico_blockdev_get_sector_size(dev);
+    uint32_t n;
+
+    if (pico_blockdev_ioctl(dev, PICO_IOCTL_BLKGETSIZE64, &bytes) == 0) {
+        if (bytes / sector_size > PICO_BLOCKDEV_SECTOR_MAX)
+            return -EFBIG;
+        *sectors = (pico_blockdev_sector_t)(bytes / sector_size);
+        return 0;
     }
+
+    int r = pico_blockdev_ioctl(dev, PICO_IOCTL_BLKGETSIZE, &n);
+    if (r < 0)
+        return r;
+    *sectors = n;
+    return 0;
+}
+
+void *pico_blockdev_direct_access(pico_blockdev_t *dev, pico_blockdev_sector_t sector, unsigned count)
+{
+    pico_blockdev_direct_t d;
+
+    if (pico_blockdev_map(&dev, &sector, &count) < 0)
+        return NULL;
+
+    d.sector = sector;
+    d.count = count;
+    d.addr = NULL;
+    if (pico_blockdev_ioctl(dev, PICO_IOCTL_BLKDIRECT, &d) < 0)
+        return NULL;
+
+    pico_object_lock(&dev->obj);
+    if (dev->readahead)
+        pico_blockdev_readahead_invalidate_locked(dev, sector, count);
+    pico_object_unlock(&dev->obj);
+
+    return d.addr;
+}
+
+int pico_blockdev_discard(pico_blockdev_t *dev, pico_blockdev_sector_t sector, unsigned count)
+{
+    pico_blockdev_range_t range;
+
+    if (count == 0)
+        return 0;
+
+    // Partitions check and translate the range on the way down
+    int r = pico_blockdev_map(&dev, &sector, &count);
+    if (r < 0)
+        return r;
+
+    if (!dev->ops->ioctl)
+        return -ENOSYS;
+
+    pico_object_lock(&dev->obj);
+    if (dev->readahead)
+        pico_blockdev_readahead_invalidate_locked(dev, sector, count);
+    pico_object_unlock(&dev->obj);
+
+    range.sector = sector;
+    range.count = count;
+    return dev->ops->ioctl(dev, PICO_IOCTL_BLKDISCARD, &range);
 }
 
 int pico_blockdev_init(pico_blockdev_t *dev, const pico_blockdev_ops_t *ops)
 {
     pico_object_init(&dev->obj, &pico_blockdev_destroy_object);
+    pico_object_set_type(&dev->obj, "blockdev");
     dev->ops = ops;
     dev->children = NULL;
     dev->parent = NULL;
+    dev->queue.head = NULL;
+    dev->queue.tail = NULL;
+    dev->queue.active = NULL;
+    dev->queue.merge = NULL;
+    dev->queue.position = 0;
+    dev->queue.plugged = 0;
+    dev->queue.sync_pending = 0;
+    dev->queue.dispatching = false;
+    dev->readahead = NULL;
+    dev->sector_size = 0;
+    dev->sector_shift = 0;
+    dev->linear.target = NULL;
+    dev->name[0] = '\0';
+    dev->hash_next = NULL;
+    dev->list_next = NULL;
+    dev->num_partitions = 0;
+    dev->registered = false;
+    dev->scan_state = 0;
+    dev->scan_owner = LOCK_INVALID_OWNER_ID;
+#if PICO_BLOCKDEV_STATS
+    memset(&dev->stats, 0, sizeof(dev->stats));
+#endif
     return 0;
 }
 
@@ -61,31 +409,62 @@ void __attribute__((weak)) pico_blockdev_unregister_event(pico_blockdev_t *dev)
 {
 }
 
-int pico_blockdev_register(pico_blockdev_t *dev)
+static int pico_blockdev_register_common(pico_blockdev_t *dev, bool deferred)
 {
-    if (!dev->parent)
+    // Devices with a stacked layer on top (e.g. a cache) are scanned through it
+    bool scan = !pico_blockdev_has_children(dev);
+
+    // Before partitions on top of it are flattened in turn
+    pico_blockdev_map_flatten(dev);
+    // Also gives the partition scan a buffer to borrow
+    pico_blockdev_buffer_reserve(dev, PICO_BLOCKDEV_BUFFER_RESERVE);
+    // Named before its partitions, which are named after it
+    pico_blockdev_registry_add(dev, scan && deferred);
+
+    if (scan && !deferred)
     {
         pico_blockdev_scan_partitions(dev);
     }
+    pico_blockdev_queue_setup(dev);
     pico_blockdev_register_event(dev);
     pico_blockdev_unref(dev);
 
     return 0;
 }
 
+int pico_blockdev_register(pico_blockdev_t *dev)
+{
+    return pico_blockdev_register_common(dev, false);
+}
+
+int pico_blockdev_register_deferred(pico_blockdev_t *dev)
+{
+    return pico_blockdev_register_common(dev, true);
+}
+
 void pico_blockdev_unregister(pico_blockdev_t *dev)
 {
-    while (dev && dev->children)
-    {
+    // Children first. Dropping the link's reference destroys a child
+    // nobody else holds, which drops the child's reference to us.
+    for (;;) {
+        pico_object_lock(&dev->obj);
         struct pico_blockdev_link_entry *link = dev->children;
-        pico_blockdev_unregister(link->dev);
-        dev = pico_blockdev_unref(dev);
-        if (dev)
-        {
+        if (link)
             dev->children = link->next;
-        }
+        pico_object_unlock(&dev->obj);
+
+        if (NULL == link)
+            break;
+        pico_blockdev_t *child = link->dev;
+        pico_object_cache_free(&link_cache, link);
+        pico_blockdev_unregister(child);
+        pico_blockdev_unref(child);
     }
+
+    bool registered = pico_blockdev_registry_remove(dev);
     pico_blockdev_unregister_event(dev);
+    if (registered)
+        pico_blockdev_unref(dev);
 }
 
 int pico_blockdev_add_child(pico_blockdev_t *dev, pico_blockdev_t *child)
@@ -96,16 +475,20 @@ int pico_blockdev_add_child(pico_blockdev_t *dev, pico_blockdev_t *child)
         return -EALREADY;
     }
 
-    link = malloc(sizeof(struct pico_blockdev_link_entry));
+    link = pico_object_cache_alloc(&link_cache);
 
     if (NULL==link)
         return -ENOMEM;
 
     pico_object_lock(&dev->obj);
 
+    // In the order added, so partitions list in table order
+    struct pico_blockdev_link_entry **tail = &dev->children;
+    while (*tail)
+        tail = &(*tail)->next;
     link->dev = child;
-    link->next = dev->children;
-    dev->children = link;
+    link->next = NULL;
+    *tail = link;
     child->parent = dev;
 
     // Reference
@@ -117,3 +500,28 @@ int pico_blockdev_add_child(pico_blockdev_t *dev, pico_blockdev_t *child)
     return 0;
 }
 
+pico_blockdev_t *pico_blockdev_next_child(pico_blockdev_t *dev, pico_blockdev_t *prev)
+{
+    struct pico_blockdev_link_entry *link;
+    pico_blockdev_t *child = NULL;
+
+    if (NULL == prev)
+        pico_blockdev_scan(dev);
+
+    pico_object_lock(&dev->obj);
+    for (link = dev->children; link && prev; link = link->next) {
+        if (link->dev == prev) {
+            link = link->next;
+            break;
+        }
+    }
+    if (link) {
+        child = link->dev;
+        pico_blockdev_ref(child);
+    }
+    pico_object_unlock(&dev->obj);
+
+    if (prev)
+        pico_blockdev_unref(prev);
+    return child;
+}
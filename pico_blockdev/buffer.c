@@ -0,0 +1,181 @@
+#include "pico/blockdev_buffer.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/errno.h>
+#include <pico/sync.h>
+
+typedef struct pico_blockdev_buffer_class__ pico_blockdev_buffer_class_t;
+
+/* Sits right before each buffer */
+typedef struct pico_blockdev_buffer_hdr__
+{
+    pico_blockdev_buffer_class_t *cls;          // NULL if the buffer is not pooled
+    struct pico_blockdev_buffer_hdr__ *next;    // Free list
+    void *mem;                                  // Allocation the buffer lives in
+} pico_blockdev_buffer_hdr_t;
+
+struct pico_blockdev_buffer_class__
+{
+    pico_blockdev_buffer_hdr_t *free;
+    pico_blockdev_buffer_stats_t stats;         // size is 0 for an unused class
+};
+
+#define BUFFER_ALIGN (PICO_BLOCKDEV_BUFFER_ALIGN > sizeof(void*) ? PICO_BLOCKDEV_BUFFER_ALIGN : sizeof(void*))
+#define BUFFER_HDR_SIZE ((sizeof(pico_blockdev_buffer_hdr_t) + BUFFER_ALIGN - 1) & ~(BUFFER_ALIGN - 1))
+
+static pico_blockdev_buffer_class_t classes[PICO_BLOCKDEV_BUFFER_CLASSES];
+static critical_section_t buffer_lock;
+static pico_object_once_t buffer_lock_once;
+
+static void pico_blockdev_buffer_lock_setup(void)
+{
+    critical_section_init(&buffer_lock);
+}
+
+static inline void pico_blockdev_buffer_init(void)
+{
+    pico_object_once(&buffer_lock_once, pico_blockdev_buffer_lock_setup);
+}
+
+/* Called with the lock held */
+static pico_blockdev_buffer_class_t *pico_blockdev_buffer_class(uint32_t size, bool create)
+{
+    pico_blockdev_buffer_class_t *unused = NULL;
+
+    for (unsigned i = 0; i < PICO_BLOCKDEV_BUFFER_CLASSES; i++) {
+        if (classes[i].stats.size == size)
+            return &classes[i];
+        if (NULL == unused && classes[i].stats.size == 0)
+            unused = &classes[i];
+    }
+    if (!create || NULL == unused)
+        return NULL;
+    unused->stats.size = size;
+    return unused;
+}
+
+static pico_blockdev_buffer_hdr_t *pico_blockdev_buffer_alloc(uint32_t size)
+{
+    uint8_t *mem = malloc(BUFFER_HDR_SIZE + size + BUFFER_ALIGN - 1);
+    if (NULL == mem)
+        return NULL;
+
+    uintptr_t data = ((uintptr_t)mem + BUFFER_HDR_SIZE + BUFFER_ALIGN - 1) & ~(uintptr_t)(BUFFER_ALIGN - 1);
+    pico_blockdev_buffer_hdr_t *hdr = (pico_blockdev_buffer_hdr_t*)(data - BUFFER_HDR_SIZE);
+    hdr->cls = NULL;
+    hdr->next = NULL;
+    hdr->mem = mem;
+    return hdr;
+}
+
+static inline void pico_blockdev_buffer_taken(pico_blockdev_buffer_class_t *cls)
+{
+    if (++cls->stats.in_use > cls->stats.high_water)
+        cls->stats.high_water = cls->stats.in_use;
+}
+
+void *pico_blockdev_buffer_get(pico_blockdev_t *dev)
+{
+    uint32_t size = pico_blockdev_get_sector_size(dev);
+    pico_blockdev_buffer_hdr_t *hdr = NULL;
+
+    pico_blockdev_buffer_init();
+
+    critical_section_enter_blocking(&buffer_lock);
+    pico_blockdev_buffer_class_t *cls = pico_blockdev_buffer_class(size, true);
+    if (cls) {
+        cls->stats.gets++;
+        hdr = cls->free;
+        if (hdr) {
+            cls->free = hdr->next;
+            pico_blockdev_buffer_taken(cls);
+        }
+    }
+    critical_section_exit(&buffer_lock);
+
+    if (NULL == hdr) {
+        // The class ran dry, or there is no class left for this size
+        hdr = pico_blockdev_buffer_alloc(size);
+        if (NULL == hdr)
+            return NULL;
+        if (cls) {
+            critical_section_enter_blocking(&buffer_lock);
+            hdr->cls = cls;
+            cls->stats.total++;
+            cls->stats.misses++;
+            pico_blockdev_buffer_taken(cls);
+            critical_section_exit(&buffer_lock);
+        }
+    }
+    return (uint8_t*)hdr + BUFFER_HDR_SIZE;
+}
+
+void pico_blockdev_buffer_put(void *buf)
+{
+    if (NULL == buf)
+        return;
+
+    pico_blockdev_buffer_hdr_t *hdr = (pico_blockdev_buffer_hdr_t*)((uint8_t*)buf - BUFFER_HDR_SIZE);
+    pico_blockdev_buffer_class_t *cls = hdr->cls;
+
+    if (NULL == cls) {
+        free(hdr->mem);
+        return;
+    }
+
+    critical_section_enter_blocking(&buffer_lock);
+    hdr->next = cls->free;
+    cls->free = hdr;
+    cls->stats.in_use--;
+    critical_section_exit(&buffer_lock);
+}
+
+int pico_blockdev_buffer_reserve(pico_blockdev_t *dev, unsigned count)
+{
+    uint32_t size = pico_blockdev_get_sector_size(dev);
+
+    pico_blockdev_buffer_init();
+
+    critical_section_enter_blocking(&buffer_lock);
+    pico_blockdev_buffer_class_t *cls = pico_blockdev_buffer_class(size, true);
+    critical_section_exit(&buffer_lock);
+
+    if (NULL == cls)
+        return -ENOSPC;
+
+    for (;;) {
+        critical_section_enter_blocking(&buffer_lock);
+        bool done = cls->stats.total >= count;
+        critical_section_exit(&buffer_lock);
+        if (done)
+            return 0;
+
+        pico_blockdev_buffer_hdr_t *hdr = pico_blockdev_buffer_alloc(size);
+        if (NULL == hdr)
+            return -ENOMEM;
+
+        critical_section_enter_blocking(&buffer_lock);
+        hdr->cls = cls;
+        hdr->next = cls->free;
+        cls->free = hdr;
+        cls->stats.total++;
+        critical_section_exit(&buffer_lock);
+    }
+}
+
+int pico_blockdev_buffer_get_stats(pico_blockdev_t *dev, pico_blockdev_buffer_stats_t *stats)
+{
+    uint32_t size = pico_blockdev_get_sector_size(dev);
+    int r = -ENOENT;
+
+    pico_blockdev_buffer_init();
+
+    critical_section_enter_blocking(&buffer_lock);
+    pico_blockdev_buffer_class_t *cls = pico_blockdev_buffer_class(size, false);
+    if (cls) {
+        *stats = cls->stats;
+        r = 0;
+    }
+    critical_section_exit(&buffer_lock);
+    return r;
+}
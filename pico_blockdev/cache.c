@@ -0,0 +1,433 @@
+#include "pico/blockdev_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pico/sync.h>
+
+#define CACHE_NONE (0xFFFF)
+#define CACHE_MAX_ENTRIES (0xFFFE)
+
+#define CACHE_FLAG_VALID (1<<0)
+#define CACHE_FLAG_DIRTY (1<<1)
+
+typedef struct
+{
+    pico_blockdev_sector_t sector;
+    uint16_t lru_prev;
+    uint16_t lru_next;
+    uint16_t hash_next;
+    uint8_t flags;
+} pico_blockdev_cache_entry_t;
+
+typedef struct pico_blockdev_cache__
+{
+    struct pico_blockdev__ dev;
+    mutex_t lock;
+    uint32_t sector_size;
+    uint16_t num_entries;
+    uint16_t hash_mask;
+    uint16_t lru_head; // Most recently used
+    uint16_t lru_tail; // Least recently used
+    uint16_t *buckets;
+    pico_blockdev_cache_entry_t *entries;
+    uint8_t *data;
+    pico_blockdev_cache_stats_t stats;
+} pico_blockdev_cache_t;
+
+static int pico_blockdev_cache_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_cache_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_cache_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data);
+static void pico_blockdev_cache_destroy(pico_blockdev_t *dev);
+
+static const pico_blockdev_ops_t cache_ops =
+{
+    .read_sector = pico_blockdev_cache_read_sector,
+    .write_sector = pico_blockdev_cache_write_sector,
+    .ioctl = pico_blockdev_cache_ioctl,
+    .destroy = pico_blockdev_cache_destroy
+};
+
+static inline uint8_t *pico_blockdev_cache_entry_data(pico_blockdev_cache_t *c, uint16_t index)
+{
+    return &c->data[ (size_t)index * c->sector_size ];
+}
+
+static inline uint16_t pico_blockdev_cache_hash(pico_blockdev_cache_t *c, pico_blockdev_sector_t sector)
+{
+    return (uint16_t)((sector ^ (sector >> 16)) & c->hash_mask);
+}
+
+static uint16_t pico_blockdev_cache_lookup(pico_blockdev_cache_t *c, pico_blockdev_sector_t sector)
+{
+    uint16_t index = c->buckets[ pico_blockdev_cache_hash(c, sector) ];
+
+    while (index != CACHE_NONE) {
+        pico_blockdev_cache_entry_t *e = &c->entries[index];
+        if (e->sector == sector)
+            break;
+        index = e->hash_next;
+    }
+    return index;
+}
+
+static void pico_blockdev_cache_unhash(pico_blockdev_cache_t *c, uint16_t index)
+{
+    pico_blockdev_cache_entry_t *e = &c->entries[index];
+    uint16_t *link = &c->buckets[ pico_blockdev_cache_hash(c, e->sector) ];
+
+    while (*link != CACHE_NONE) {
+        if (*link == index) {
+            *link = e->hash_next;
+            break;
+        }
+        link = &c->entries[*link].hash_next;
+    }
+    e->flags = 0;
+}
+
+static void pico_blockdev_cache_hash_insert(pico_blockdev_cache_t *c, uint16_t index, pico_blockdev_sector_t sector)
+{
+    pico_blockdev_cache_entry_t *e = &c->entries[index];
+    uint16_t *bucket = &c->buckets[ pico_blockdev_cache_hash(c, sector) ];
+
+    e->sector = sector;
+    e->flags = CACHE_FLAG_VALID;
+    e->hash_next = *bucket;
+    *bucket = index;
+}
+
+static void pico_blockdev_cache_lru_remove(pico_blockdev_cache_t *c, uint16_t index)
+{
+    pico_blockdev_cache_entry_t *e = &c->entries[index];
+
+    if (e->lru_prev != CACHE_NONE)
+        c->entries[e->lru_prev].lru_next = e->lru_next;
+    else
+        c->lru_head = e->lru_next;
+
+    if (e->lru_next != CACHE_NONE)
+        c->entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        c->lru_tail = e->lru_prev;
+}
+
+static void pico_blockdev_cache_lru_push(pico_blockdev_cache_t *c, uint16_t index)
+{
+    pico_blockdev_cache_entry_t *e = &c->entries[index];
+
+    e->lru_prev = CACHE_NONE;
+    e->lru_next = c->lru_head;
+    if (c->lru_head != CACHE_NONE)
+        c->entries[c->lru_head].lru_prev = index;
+    else
+        c->lru_tail = index;
+    c->lru_head = index;
+}
+
+static inline void pico_blockdev_cache_touch(pico_blockdev_cache_t *c, uint16_t index)
+{
+    if (c->lru_head != index) {
+        pico_blockdev_cache_lru_remove(c, index);
+        pico_blockdev_cache_lru_push(c, index);
+    }
+}
+
+static int pico_blockdev_cache_writeback(pico_blockdev_cache_t *c, uint16_t index)
+{
+    pico_blockdev_cache_entry_t *e = &c->entries[index];
+    int r = pico_blockdev_write_sector(c->dev.parent,
+                                       pico_blockdev_cache_entry_data(c, index),
+                                       e->sector, 1);
+    if (r != 1)
+        return r < 0 ? r : -EIO;
+
+    e->flags &= ~CACHE_FLAG_DIRTY;
+    c->stats.writebacks++;
+    return 0;
+}
+
+/*
+ Recycle the least recently used entry for "sector". Dirty victims are
+ written back first. Returns the entry index or a negative error.
+ */
+static int pico_blockdev_cache_alloc(pico_blockdev_cache_t *c, pico_blockdev_sector_t sector)
+{
+    uint16_t index = c->lru_tail;
+    pico_blockdev_cache_entry_t *e = &c->entries[index];
+
+    if (e->flags & CACHE_FLAG_DIRTY) {
+        int r = pico_blockdev_cache_writeback(c, index);
+        if (r < 0)
+            return r;
+    }
+    if (e->flags & CACHE_FLAG_VALID) {
+        pico_blockdev_cache_unhash(c, index);
+        c->stats.evictions++;
+    }
+    pico_blockdev_cache_hash_insert(c, index, sector);
+    pico_blockdev_cache_touch(c, index);
+    return index;
+}
+
+static void pico_blockdev_cache_invalidate(pico_blockdev_cache_t *c, uint16_t index)
+{
+    pico_blockdev_cache_unhash(c, index);
+    // Make it the first candidate for reuse
+    pico_blockdev_cache_lru_remove(c, index);
+    pico_blockdev_cache_entry_t *e = &c->entries[index];
+    e->lru_next = CACHE_NONE;
+    e->lru_prev = c->lru_tail;
+    if (c->lru_tail != CACHE_NONE)
+        c->entries[c->lru_tail].lru_next = index;
+    else
+        c->lru_head = index;
+    c->lru_tail = index;
+}
+
+static int pico_blockdev_cache_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_cache_t *c = (pico_blockdev_cache_t*)dev;
+    unsigned i = 0;
+    int r = 0;
+
+    mutex_enter_blocking(&c->lock);
+
+    while (i < count) {
+        uint16_t index = pico_blockdev_cache_lookup(c, start_sector + i);
+
+        if (index != CACHE_NONE) {
+            memcpy(&data[i * c->sector_size], pico_blockdev_cache_entry_data(c, index), c->sector_size);
+            pico_blockdev_cache_touch(c, index);
+            c->stats.hits++;
+            i++;
+            continue;
+        }
+
+        // Read the whole run of missing sectors in a single request
+        unsigned run = 1;
+        while ((i + run < count) &&
+               pico_blockdev_cache_lookup(c, start_sector + i + run) == CACHE_NONE) {
+            run++;
+        }
+
+        r = pico_blockdev_read_sector(dev->parent, &data[i * c->sector_size], start_sector + i, run);
+        if (r != (int)run) {
+            if (r >= 0)
+                r = -EIO;
+            break;
+        }
+        c->stats.misses += run;
+
+        // Large runs are streaming reads: do not let them flush the working set.
+        if (run <= c->num_entries / 2) {
+            for (unsigned j = 0; j < run; j++) {
+                r = pico_blockdev_cache_alloc(c, start_sector + i + j);
+                if (r < 0)
+                    break;
+                memcpy(pico_blockdev_cache_entry_data(c, r), &data[(i + j) * c->sector_size], c->sector_size);
+            }
+            if (r < 0)
+                break;
+        }
+        i += run;
+    }
+
+    mutex_exit(&c->lock);
+
+    return r < 0 ? r : (int)count;
+}
+
+static int pico_blockdev_cache_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_cache_t *c = (pico_blockdev_cache_t*)dev;
+    int r = 0;
+
+    mutex_enter_blocking(&c->lock);
+
+    if (count > c->num_entries / 2) {
+        // Large write: send it straight through, refreshing any cached copy.
+        r = pico_blockdev_write_sector(dev->parent, data, start_sector, count);
+        for (unsigned i = 0; i < count; i++) {
+            uint16_t index = pico_blockdev_cache_lookup(c, start_sector + i);
+            if (index == CACHE_NONE)
+                continue;
+            if (r == (int)count) {
+                memcpy(pico_blockdev_cache_entry_data(c, index), &data[i * c->sector_size], c->sector_size);
+                c->entries[index].flags &= ~CACHE_FLAG_DIRTY;
+            } else {
+                pico_blockdev_cache_invalidate(c, index);
+            }
+        }
+        if (r >= 0 && r != (int)count)
+            r = -EIO;
+    } else {
+        for (unsigned i = 0; i < count; i++) {
+            int index = pico_blockdev_cache_lookup(c, start_sector + i);
+            if (index == CACHE_NONE) {
+                index = pico_blockdev_cache_alloc(c, start_sector + i);
+                if (index < 0) {
+                    r = index;
+                    break;
+                }
+            } else {
+                pico_blockdev_cache_touch(c, index);
+            }
+            memcpy(pico_blockdev_cache_entry_data(c, index), &data[i * c->sector_size], c->sector_size);
+            c->entries[index].flags |= CACHE_FLAG_DIRTY;
+        }
+    }
+
+    mutex_exit(&c->lock);
+
+    return r < 0 ? r : (int)count;
+}
+
+static int pico_blockdev_cache_flush_locked(pico_blockdev_cache_t *c)
+{
+    int ret = 0;
+
+    for (uint16_t index = 0; index < c->num_entries; index++) {
+        if (c->entries[index].flags & CACHE_FLAG_DIRTY) {
+            int r = pico_blockdev_cache_writeback(c, index);
+            if (r < 0)
+                ret = r;
+        }
+    }
+    return ret;
+}
+
+int pico_blockdev_cache_flush(pico_blockdev_t *dev)
+{
+    pico_blockdev_cache_t *c = (pico_blockdev_cache_t*)dev;
+
+    mutex_enter_blocking(&c->lock);
+    int r = pico_blockdev_cache_flush_locked(c);
+    mutex_exit(&c->lock);
+
+    return r;
+}
+
+void pico_blockdev_cache_get_stats(pico_blockdev_t *dev, pico_blockdev_cache_stats_t *stats)
+{
+    pico_blockdev_cache_t *c = (pico_blockdev_cache_t*)dev;
+
+    mutex_enter_blocking(&c->lock);
+    *stats = c->stats;
+    mutex_exit(&c->lock);
+}
+
+/* Drop cached copies of a discarded range, dirty ones included */
+static void pico_blockdev_cache_discard(pico_blockdev_cache_t *c, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    mutex_enter_blocking(&c->lock);
+
+    if (count > c->num_entries) {
+        for (uint16_t index = 0; index < c->num_entries; index++) {
+            pico_blockdev_cache_entry_t *e = &c->entries[index];
+            if ((e->flags & CACHE_FLAG_VALID) && e->sector >= start_sector && e->sector - start_sector < count)
+                pico_blockdev_cache_invalidate(c, index);
+        }
+    } else {
+        for (unsigned i = 0; i < count; i++) {
+            uint16_t index = pico_blockdev_cache_lookup(c, start_sector + i);
+            if (index != CACHE_NONE)
+                pico_blockdev_cache_invalidate(c, index);
+        }
+    }
+
+    mutex_exit(&c->lock);
+}
+
+static int pico_blockdev_cache_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data)
+{
+    int r = 0;
+
+    // The parent's memory may be older than cached data
+    if (cmd == PICO_IOCTL_BLKDIRECT)
+        return -ENOTSUP;
+
+    if (cmd == PICO_IOCTL_BLKFLSBUF) {
+        r = pico_blockdev_cache_flush(dev);
+        if (r < 0)
+            return r;
+    }
+    if (cmd == PICO_IOCTL_BLKDISCARD) {
+        pico_blockdev_range_t *range = (pico_blockdev_range_t*)data;
+        pico_blockdev_cache_discard((pico_blockdev_cache_t*)dev, range->sector, range->count);
+    }
+    return pico_blockdev_ioctl(dev->parent, cmd, data);
+}
+
+static void pico_blockdev_cache_destroy(pico_blockdev_t *dev)
+{
+    pico_blockdev_cache_t *c = (pico_blockdev_cache_t*)dev;
+
+    if (dev->parent) {
+        int r = pico_blockdev_cache_flush_locked(c);
+        if (r < 0) {
+            BLKDEV_ERROR(dev, "Cannot write back cache, error %d\n", r);
+        }
+        pico_blockdev_unref(dev->parent);
+    }
+    free(c->data);
+    free(c->entries);
+    free(c->buckets);
+    free(c);
+}
+
+pico_blockdev_t *pico_blockdev_cache_create(pico_blockdev_t *parent, unsigned num_sectors)
+{
+    uint32_t sector_size = pico_blockdev_get_sector_size(parent);
+    unsigned buckets = 1;
+
+    if (num_sectors == 0 || num_sectors > CACHE_MAX_ENTRIES)
+        return NULL;
+
+    while (buckets < num_sectors)
+        buckets <<= 1;
+
+    pico_blockdev_cache_t *c = calloc(1, sizeof(pico_blockdev_cache_t));
+    if (NULL == c)
+        return NULL;
+
+    c->entries = calloc(num_sectors, sizeof(pico_blockdev_cache_entry_t));
+    c->buckets = malloc(buckets * sizeof(uint16_t));
+    c->data = malloc((size_t)num_sectors * sector_size);
+
+    if (!c->entries || !c->buckets || !c->data) {
+        free(c->data);
+        free(c->buckets);
+        free(c->entries);
+        free(c);
+        return NULL;
+    }
+
+    mutex_init(&c->lock);
+    c->sector_size = sector_size;
+    c->num_entries = num_sectors;
+    c->hash_mask = buckets - 1;
+    c->lru_head = CACHE_NONE;
+    c->lru_tail = CACHE_NONE;
+
+    for (unsigned i = 0; i < buckets; i++)
+        c->buckets[i] = CACHE_NONE;
+
+    for (uint16_t i = 0; i < num_sectors; i++)
+        pico_blockdev_cache_lru_push(c, i);
+
+    pico_blockdev_init(&c->dev, &cache_ops);
+    pico_blockdev_set_name(&c->dev, "cache");
+    pico_blockdev_set_sector_size(&c->dev, sector_size);
+
+    int r = pico_blockdev_add_child(parent, &c->dev);
+    if (r < 0) {
+        BLKDEV_ERROR(parent, "Cannot add cache, err %d %s\n", r, strerror(-r));
+        pico_blockdev_unref(&c->dev);
+        return NULL;
+    }
+
+    BLKDEV_INFO(parent, "Sector cache created, %u sectors of %lu bytes\n",
+                num_sectors, (unsigned long)sector_size);
+
+    return &c->dev;
+}
@@ -0,0 +1,494 @@
+#include "pico/blockdev_coalesce.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pico/sync.h>
+#include <pico/time.h>
+
+#define COALESCE_UNUSED PICO_BLOCKDEV_SECTOR_MAX
+#define COALESCE_MAX_BLOCK_SECTORS (1024)
+
+typedef struct
+{
+    pico_blockdev_sector_t start;  // First sector of the staged block, COALESCE_UNUSED if free
+    uint64_t since;                // When the first sector was staged
+    uint32_t *valid;               // One bit per staged sector
+    uint32_t *discarded;           // Sectors discarded since the block was staged, in the same allocation
+    uint8_t *data;
+} pico_blockdev_coalesce_buffer_t;
+
+typedef struct
+{
+    struct pico_blockdev__ dev;
+    mutex_t lock;
+    uint32_t sector_size;
+    unsigned block_sectors;
+    unsigned num_buffers;
+    uint64_t timeout_us;
+    pico_blockdev_sector_t num_sectors;
+    pico_blockdev_coalesce_buffer_t *buffers;
+    pico_blockdev_coalesce_stats_t stats;
+} pico_blockdev_coalesce_t;
+
+static int pico_blockdev_coalesce_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_coalesce_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_coalesce_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data);
+static void pico_blockdev_coalesce_destroy(pico_blockdev_t *dev);
+
+static const pico_blockdev_ops_t coalesce_ops =
+{
+    .read_sector = pico_blockdev_coalesce_read_sector,
+    .write_sector = pico_blockdev_coalesce_write_sector,
+    .ioctl = pico_blockdev_coalesce_ioctl,
+    .destroy = pico_blockdev_coalesce_destroy
+};
+
+static inline bool pico_blockdev_coalesce_test(pico_blockdev_coalesce_buffer_t *b, unsigned i)
+{
+    return b->valid[i / 32] & (1u << (i % 32));
+}
+
+/* Words in each of the valid and discarded bitmaps */
+static inline unsigned pico_blockdev_coalesce_words(pico_blockdev_coalesce_t *c)
+{
+    return (c->block_sectors + 31) / 32;
+}
+
+static inline pico_blockdev_sector_t pico_blockdev_coalesce_block(pico_blockdev_coalesce_t *c, pico_blockdev_sector_t sector)
+{
+    return sector - sector % c->block_sectors;
+}
+
+/* Sectors in the block starting at start, the last one may be short */
+static inline unsigned pico_blockdev_coalesce_count(pico_blockdev_coalesce_t *c, pico_blockdev_sector_t start)
+{
+    return MIN(c->block_sectors, c->num_sectors - start);
+}
+
+static pico_blockdev_coalesce_buffer_t *pico_blockdev_coalesce_find(pico_blockdev_coalesce_t *c, pico_blockdev_sector_t start)
+{
+    for (unsigned i = 0; i < c->num_buffers; i++) {
+        if (c->buffers[i].start == start)
+            return &c->buffers[i];
+    }
+    return NULL;
+}
+
+/*
+ Write back only the runs that were written. Filling the block from the
+ parent would make sectors discarded meanwhile live again.
+ */
+static int pico_blockdev_coalesce_flush_runs(pico_blockdev_coalesce_t *c, pico_blockdev_coalesce_buffer_t *b)
+{
+    unsigned count = pico_blockdev_coalesce_count(c, b->start);
+
+    for (unsigned i = 0; i < count; ) {
+        if (!pico_blockdev_coalesce_test(b, i)) {
+            i++;
+            continue;
+        }
+        unsigned run = 1;
+        while (i + run < count && pico_blockdev_coalesce_test(b, i + run))
+            run++;
+
+        int r = pico_blockdev_write_sector(c->dev.parent, &b->data[i * c->sector_size], b->start + i, run);
+        if (r != (int)run)
+            return r < 0 ? r : -EIO;
+        i += run;
+    }
+
+    c->stats.split_flushes++;
+    b->start = COALESCE_UNUSED;
+    return 0;
+}
+
+static int pico_blockdev_coalesce_flush_buffer(pico_blockdev_coalesce_t *c, pico_blockdev_coalesce_buffer_t *b)
+{
+    unsigned count = pico_blockdev_coalesce_count(c, b->start);
+    unsigned filled = 0;
+    int r;
+
+    for (unsigned w = 0; w < pico_blockdev_coalesce_words(c); w++) {
+        if (b->discarded[w])
+            return pico_blockdev_coalesce_flush_runs(c, b);
+    }
+
+    // Read the sectors that were not written, so the block goes out in one piece
+    for (unsigned i = 0; i < count; ) {
+        if (pico_blockdev_coalesce_test(b, i)) {
+            i++;
+            continue;
+        }
+        unsigned run = 1;
+        while (i + run < count && !pico_blockdev_coalesce_test(b, i + run))
+            run++;
+
+        // Everything discarded
+        if (run == count) {
+            b->start = COALESCE_UNUSED;
+            return 0;
+        }
+
+        r = pico_blockdev_read_sector(c->dev.parent, &b->data[i * c->sector_size], b->start + i, run);
+        if (r != (int)run)
+            return r < 0 ? r : -EIO;
+        filled += run;
+        i += run;
+    }
+
+    r = pico_blockdev_write_sector(c->dev.parent, b->data, b->start, count);
+    if (r != (int)count)
+        return r < 0 ? r : -EIO;
+
+    if (filled) {
+        c->stats.partial_flushes++;
+        c->stats.fill_sectors += filled;
+    } else {
+        c->stats.full_flushes++;
+    }
+    b->start = COALESCE_UNUSED;
+    return 0;
+}
+
+static int pico_blockdev_coalesce_flush_locked(pico_blockdev_coalesce_t *c)
+{
+    int ret = 0;
+
+    for (unsigned i = 0; i < c->num_buffers; i++) {
+        if (c->buffers[i].start != COALESCE_UNUSED) {
+            int r = pico_blockdev_coalesce_flush_buffer(c, &c->buffers[i]);
+            if (r < 0)
+                ret = r;
+        }
+    }
+    return ret;
+}
+
+static int pico_blockdev_coalesce_expire(pico_blockdev_coalesce_t *c)
+{
+    uint64_t now = time_us_64();
+    int ret = 0;
+
+    if (c->timeout_us == 0)
+        return 0;
+
+    for (unsigned i = 0; i < c->num_buffers; i++) {
+        pico_blockdev_coalesce_buffer_t *b = &c->buffers[i];
+        if (b->start != COALESCE_UNUSED && now - b->since >= c->timeout_us) {
+            int r = pico_blockdev_coalesce_flush_buffer(c, b);
+            if (r < 0)
+                ret = r;
+            else
+                c->stats.timeouts++;
+        }
+    }
+    return ret;
+}
+
+/*
+ Buffer for the block starting at start. A new block takes a free buffer,
+ or the one staged the longest after writing it out.
+ */
+static pico_blockdev_coalesce_buffer_t *pico_blockdev_coalesce_stage(pico_blockdev_coalesce_t *c, pico_blockdev_sector_t start, int *err)
+{
+    pico_blockdev_coalesce_buffer_t *b = pico_blockdev_coalesce_find(c, start);
+    if (b)
+        return b;
+
+    for (unsigned i = 0; i < c->num_buffers; i++) {
+        pico_blockdev_coalesce_buffer_t *candidate = &c->buffers[i];
+        if (candidate->start == COALESCE_UNUSED) {
+            b = candidate;
+            break;
+        }
+        if (!b || candidate->since < b->since)
+            b = candidate;
+    }
+
+    if (b->start != COALESCE_UNUSED) {
+        *err = pico_blockdev_coalesce_flush_buffer(c, b);
+        if (*err < 0)
+            return NULL;
+    }
+
+    b->start = start;
+    b->since = time_us_64();
+    memset(b->valid, 0, 2 * pico_blockdev_coalesce_words(c) * sizeof(uint32_t));
+    return b;
+}
+
+static int pico_blockdev_coalesce_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_coalesce_t *c = (pico_blockdev_coalesce_t*)dev;
+    unsigned i = 0;
+    int r = 0;
+
+    mutex_enter_blocking(&c->lock);
+
+    pico_blockdev_coalesce_expire(c);
+
+    while (i < count) {
+        pico_blockdev_sector_t sector = start_sector + i;
+        pico_blockdev_sector_t block = pico_blockdev_coalesce_block(c, sector);
+        pico_blockdev_coalesce_buffer_t *b = pico_blockdev_coalesce_find(c, block);
+
+        if (b && pico_blockdev_coalesce_test(b, sector - block)) {
+            memcpy(&data[i * c->sector_size], &b->data[(sector - block) * c->sector_size], c->sector_size);
+            i++;
+            continue;
+        }
+
+        // Read the run of sectors the buffers do not have in a single request
+        unsigned run = 1;
+        while (i + run < count) {
+            sector = start_sector + i + run;
+            block = pico_blockdev_coalesce_block(c, sector);
+            b = pico_blockdev_coalesce_find(c, block);
+            if (b && pico_blockdev_coalesce_test(b, sector - block))
+                break;
+            run++;
+        }
+
+        r = pico_blockdev_read_sector(dev->parent, &data[i * c->sector_size], start_sector + i, run);
+        if (r != (int)run) {
+            if (r >= 0)
+                r = -EIO;
+            break;
+        }
+        i += run;
+    }
+
+    mutex_exit(&c->lock);
+
+    return r < 0 ? r : (int)count;
+}
+
+static int pico_blockdev_coalesce_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_coalesce_t *c = (pico_blockdev_coalesce_t*)dev;
+    unsigned i = 0;
+    int r = 0;
+
+    if (start_sector >= c->num_sectors || count > c->num_sectors - start_sector)
+        return -EINVAL;
+
+    mutex_enter_blocking(&c->lock);
+
+    pico_blockdev_coalesce_expire(c);
+
+    while (i < count) {
+        pico_blockdev_sector_t sector = start_sector + i;
+        pico_blockdev_sector_t block = pico_blockdev_coalesce_block(c, sector);
+        unsigned offset = sector - block;
+        unsigned block_count = pico_blockdev_coalesce_count(c, block);
+        unsigned n = MIN(count - i, block_count - offset);
+
+        if (offset == 0 && n == block_count) {
+            // Whole blocks go straight through and replace anything staged for them
+            unsigned whole = (count - i) - (count - i) % c->block_sectors;
+            if (whole == 0)
+                whole = n;
+            for (unsigned j = 0; j < c->num_buffers; j++) {
+                if (c->buffers[j].start != COALESCE_UNUSED &&
+                    c->buffers[j].start >= sector && c->buffers[j].start - sector < whole)
+                    c->buffers[j].start = COALESCE_UNUSED;
+            }
+            r = pico_blockdev_write_sector(dev->parent, &data[i * c->sector_size], sector, whole);
+            if (r != (int)whole) {
+                if (r >= 0)
+                    r = -EIO;
+                break;
+            }
+            c->stats.direct += whole;
+            i += whole;
+            continue;
+        }
+
+        pico_blockdev_coalesce_buffer_t *b = pico_blockdev_coalesce_stage(c, block, &r);
+        if (NULL == b)
+            break;
+
+        memcpy(&b->data[offset * c->sector_size], &data[i * c->sector_size], n * c->sector_size);
+        for (unsigned j = offset; j < offset + n; j++) {
+            b->valid[j / 32] |= 1u << (j % 32);
+            b->discarded[j / 32] &= ~(1u << (j % 32));
+        }
+        c->stats.staged += n;
+        i += n;
+
+        // Complete: no reason to wait
+        unsigned j = 0;
+        while (j < block_count && pico_blockdev_coalesce_test(b, j))
+            j++;
+        if (j == block_count) {
+            r = pico_blockdev_coalesce_flush_buffer(c, b);
+            if (r < 0)
+                break;
+        }
+    }
+
+    mutex_exit(&c->lock);
+
+    return r < 0 ? r : (int)count;
+}
+
+/* Forget staged copies of a discarded range */
+static void pico_blockdev_coalesce_discard(pico_blockdev_coalesce_t *c, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    mutex_enter_blocking(&c->lock);
+
+    for (unsigned i = 0; i < c->num_buffers; i++) {
+        pico_blockdev_coalesce_buffer_t *b = &c->buffers[i];
+        if (b->start == COALESCE_UNUSED)
+            continue;
+        for (unsigned j = 0; j < c->block_sectors; j++) {
+            if (b->start + j >= start_sector && b->start + j - start_sector < count) {
+                b->valid[j / 32] &= ~(1u << (j % 32));
+                b->discarded[j / 32] |= 1u << (j % 32);
+            }
+        }
+    }
+
+    mutex_exit(&c->lock);
+}
+
+int pico_blockdev_coalesce_flush(pico_blockdev_t *dev)
+{
+    pico_blockdev_coalesce_t *c = (pico_blockdev_coalesce_t*)dev;
+
+    mutex_enter_blocking(&c->lock);
+    int r = pico_blockdev_coalesce_flush_locked(c);
+    mutex_exit(&c->lock);
+
+    return r;
+}
+
+int pico_blockdev_coalesce_poll(pico_blockdev_t *dev)
+{
+    pico_blockdev_coalesce_t *c = (pico_blockdev_coalesce_t*)dev;
+
+    mutex_enter_blocking(&c->lock);
+    int r = pico_blockdev_coalesce_expire(c);
+    mutex_exit(&c->lock);
+
+    return r;
+}
+
+void pico_blockdev_coalesce_get_stats(pico_blockdev_t *dev, pico_blockdev_coalesce_stats_t *stats)
+{
+    pico_blockdev_coalesce_t *c = (pico_blockdev_coalesce_t*)dev;
+
+    mutex_enter_blocking(&c->lock);
+    *stats = c->stats;
+    mutex_exit(&c->lock);
+}
+
+static int pico_blockdev_coalesce_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data)
+{
+    pico_blockdev_coalesce_t *c = (pico_blockdev_coalesce_t*)dev;
+    int r = 0;
+
+    // The parent's memory may be older than staged data
+    if (cmd == PICO_IOCTL_BLKDIRECT)
+        return -ENOTSUP;
+
+    if (cmd == PICO_IOCTL_BLKIOOPT) {
+        *(uint32_t*)data = c->block_sectors * c->sector_size;
+        return 0;
+    }
+    if (cmd == PICO_IOCTL_BLKFLSBUF) {
+        r = pico_blockdev_coalesce_flush(dev);
+        if (r < 0)
+            return r;
+    }
+    if (cmd == PICO_IOCTL_BLKDISCARD) {
+        pico_blockdev_range_t *range = (pico_blockdev_range_t*)data;
+        pico_blockdev_coalesce_discard(c, range->sector, range->count);
+    }
+    return pico_blockdev_ioctl(dev->parent, cmd, data);
+}
+
+static void pico_blockdev_coalesce_destroy(pico_blockdev_t *dev)
+{
+    pico_blockdev_coalesce_t *c = (pico_blockdev_coalesce_t*)dev;
+
+    if (dev->parent) {
+        int r = pico_blockdev_coalesce_flush_locked(c);
+        if (r < 0) {
+            BLKDEV_ERROR(dev, "Cannot write back staged blocks, error %d\n", r);
+        }
+        pico_blockdev_unref(dev->parent);
+    }
+    for (unsigned i = 0; i < c->num_buffers; i++) {
+        free(c->buffers[i].data);
+        free(c->buffers[i].valid);
+    }
+    free(c->buffers);
+    free(c);
+}
+
+pico_blockdev_t *pico_blockdev_coalesce_create(pico_blockdev_t *parent, unsigned block_sectors,
+                                               unsigned num_buffers, uint32_t timeout_ms)
+{
+    uint32_t sector_size = pico_blockdev_get_sector_size(parent);
+    pico_blockdev_sector_t num_sectors;
+    uint32_t io_opt;
+
+    if (block_sectors == 0) {
+        if (pico_blockdev_ioctl(parent, PICO_IOCTL_BLKIOOPT, &io_opt) < 0 || io_opt < sector_size)
+            io_opt = 4096;
+        block_sectors = MAX(io_opt / sector_size, 1);
+    }
+    if (num_buffers == 0 || block_sectors > COALESCE_MAX_BLOCK_SECTORS ||
+        pico_blockdev_get_sectors(parent, &num_sectors) < 0)
+        return NULL;
+
+    pico_blockdev_coalesce_t *c = calloc(1, sizeof(pico_blockdev_coalesce_t));
+    if (NULL == c)
+        return NULL;
+
+    c->buffers = calloc(num_buffers, sizeof(pico_blockdev_coalesce_buffer_t));
+    if (NULL == c->buffers) {
+        free(c);
+        return NULL;
+    }
+    c->num_buffers = num_buffers;
+
+    for (unsigned i = 0; i < num_buffers; i++) {
+        c->buffers[i].start = COALESCE_UNUSED;
+        c->buffers[i].valid = calloc(2 * ((block_sectors + 31) / 32), sizeof(uint32_t));
+        c->buffers[i].discarded = c->buffers[i].valid + (block_sectors + 31) / 32;
+        c->buffers[i].data = malloc((size_t)block_sectors * sector_size);
+        if (!c->buffers[i].valid || !c->buffers[i].data) {
+            for (unsigned j = 0; j <= i; j++) {
+                free(c->buffers[j].data);
+                free(c->buffers[j].valid);
+            }
+            free(c->buffers);
+            free(c);
+            return NULL;
+        }
+    }
+
+    mutex_init(&c->lock);
+    c->sector_size = sector_size;
+    c->block_sectors = block_sectors;
+    c->timeout_us = (uint64_t)timeout_ms * 1000;
+    c->num_sectors = num_sectors;
+
+    pico_blockdev_init(&c->dev, &coalesce_ops);
+    pico_blockdev_set_name(&c->dev, "wc");
+    pico_blockdev_set_sector_size(&c->dev, sector_size);
+
+    int r = pico_blockdev_add_child(parent, &c->dev);
+    if (r < 0) {
+        BLKDEV_ERROR(parent, "Cannot add write coalescing, err %d %s\n", r, strerror(-r));
+        pico_blockdev_unref(&c->dev);
+        return NULL;
+    }
+
+    BLKDEV_INFO(parent, "Write coalescing created, %u buffers of %u sectors\n",
+                num_buffers, block_sectors);
+
+    return &c->dev;
+}
@@ -0,0 +1,126 @@
+#include "pico/blockdev_ftl.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <hardware/flash.h>
+#include <hardware/regs/addressmap.h>
+#include <pico/flash.h>
+
+/* How long program and erase wait for the other core or the scheduler to stop using flash */
+#ifndef PICO_BLOCKDEV_FLASH_TIMEOUT_MS
+#define PICO_BLOCKDEV_FLASH_TIMEOUT_MS 100
+#endif
+
+typedef struct
+{
+    pico_blockdev_flash_t flash;
+    uint32_t offset;               // From the start of flash
+    uint32_t op_offset;            // Arguments of the operation run by flash_safe_execute()
+    const void *op_data;
+    uint32_t op_len;
+    uint8_t bounce[FLASH_PAGE_SIZE]; // Source in RAM for data that lives in flash
+} pico_blockdev_flash_rp2040_t;
+
+static void pico_blockdev_flash_rp2040_do_program(void *param)
+{
+    pico_blockdev_flash_rp2040_t *f = param;
+
+    flash_range_program(f->op_offset, f->op_data, f->op_len);
+}
+
+static void pico_blockdev_flash_rp2040_do_erase(void *param)
+{
+    pico_blockdev_flash_rp2040_t *f = param;
+
+    flash_range_erase(f->op_offset, FLASH_SECTOR_SIZE);
+}
+
+/*
+ XIP is off while the flash is programmed or erased, so the other core
+ is kept out of flash as well, not only interrupts on this one
+ */
+static int pico_blockdev_flash_rp2040_execute(pico_blockdev_flash_rp2040_t *f, void (*func)(void*))
+{
+    int r = flash_safe_execute(func, f, PICO_BLOCKDEV_FLASH_TIMEOUT_MS);
+
+    if (r == PICO_ERROR_TIMEOUT)
+        return -EBUSY;
+    return r == PICO_OK ? 0 : -EIO;
+}
+
+static inline bool pico_blockdev_flash_rp2040_in_ram(const void *data, uint32_t len)
+{
+    return (uintptr_t)data >= SRAM_BASE && (uintptr_t)data + len <= SRAM_END;
+}
+
+static int pico_blockdev_flash_rp2040_read(pico_blockdev_flash_t *flash, uint32_t offset, void *data, uint32_t len)
+{
+    pico_blockdev_flash_rp2040_t *f = (pico_blockdev_flash_rp2040_t*)flash;
+
+    // The SDK flushes the XIP cache after program and erase
+    memcpy(data, (const void*)(XIP_BASE + f->offset + offset), len);
+    return 0;
+}
+
+static int pico_blockdev_flash_rp2040_program(pico_blockdev_flash_t *flash, uint32_t offset, const void *data, uint32_t len)
+{
+    pico_blockdev_flash_rp2040_t *f = (pico_blockdev_flash_rp2040_t*)flash;
+
+    if ((offset | len) & (FLASH_PAGE_SIZE - 1))
+        return -EINVAL;
+
+    if (pico_blockdev_flash_rp2040_in_ram(data, len)) {
+        f->op_offset = f->offset + offset;
+        f->op_data = data;
+        f->op_len = len;
+        return pico_blockdev_flash_rp2040_execute(f, pico_blockdev_flash_rp2040_do_program);
+    }
+
+    // Data in flash cannot be read while it is being programmed: copy it a page at a time
+    for (uint32_t done = 0; done < len; done += FLASH_PAGE_SIZE) {
+        memcpy(f->bounce, (const uint8_t*)data + done, FLASH_PAGE_SIZE);
+        f->op_offset = f->offset + offset + done;
+        f->op_data = f->bounce;
+        f->op_len = FLASH_PAGE_SIZE;
+        int r = pico_blockdev_flash_rp2040_execute(f, pico_blockdev_flash_rp2040_do_program);
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+static int pico_blockdev_flash_rp2040_erase(pico_blockdev_flash_t *flash, uint32_t offset)
+{
+    pico_blockdev_flash_rp2040_t *f = (pico_blockdev_flash_rp2040_t*)flash;
+
+    if (offset & (FLASH_SECTOR_SIZE - 1))
+        return -EINVAL;
+
+    f->op_offset = f->offset + offset;
+    return pico_blockdev_flash_rp2040_execute(f, pico_blockdev_flash_rp2040_do_erase);
+}
+
+static const pico_blockdev_flash_ops_t flash_rp2040_ops =
+{
+    .read = pico_blockdev_flash_rp2040_read,
+    .program = pico_blockdev_flash_rp2040_program,
+    .erase = pico_blockdev_flash_rp2040_erase
+};
+
+pico_blockdev_flash_t *pico_blockdev_flash_rp2040_create(uint32_t offset, uint32_t size)
+{
+    if ((offset | size) & (FLASH_SECTOR_SIZE - 1) || size == 0)
+        return NULL;
+
+    pico_blockdev_flash_rp2040_t *f = calloc(1, sizeof(pico_blockdev_flash_rp2040_t));
+    if (NULL == f)
+        return NULL;
+
+    f->flash.ops = &flash_rp2040_ops;
+    f->flash.size = size;
+    f->flash.erase_size = FLASH_SECTOR_SIZE;
+    f->flash.program_size = FLASH_PAGE_SIZE;
+    f->offset = offset;
+
+    return &f->flash;
+}
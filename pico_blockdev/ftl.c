@@ -0,0 +1,720 @@
+#include "pico/blockdev_ftl.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pico/sync.h>
+
+#define FTL_SECTOR_SIZE (512)
+#define FTL_MAGIC (0x32544650)     // "PFT2"
+#define FTL_NONE (0xFFFF)
+#define FTL_SEQ_FREE (0xFFFFFFFF)
+#define FTL_TAG_FREE (0xFFFFFFFF)
+#define FTL_TAG_DEAD (0)
+
+#define FTL_HOT (0)                // Host writes
+#define FTL_COLD (1)               // Garbage collection copies
+
+#define FTL_BLOCK_BLANK (0)        // Unknown contents, erase before use
+#define FTL_BLOCK_FREE (1)         // Erased, header written
+#define FTL_BLOCK_OPEN (2)
+#define FTL_BLOCK_FULL (3)
+
+/* Free blocks the write path keeps: a host block may only be opened while one is left for the cold stream */
+#define FTL_MIN_FREE (2)
+#define FTL_MIN_RESERVED (4)
+
+/* Header entry of a data slot, programmed with the data */
+typedef struct
+{
+    uint32_t tag;                  // Logical sector + 1, FTL_TAG_DEAD once discarded
+    uint32_t seq;                  // Order of the program: the highest copy of a sector is the current one
+} pico_blockdev_ftl_slot_t;
+
+/* First sector of every erase block, the rest are data slots */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t erase_count;
+    uint32_t seq;                  // FTL_SEQ_FREE until the block is opened
+    uint32_t stream;               // Stream the block was opened for
+    pico_blockdev_ftl_slot_t slots[];
+} pico_blockdev_ftl_header_t;
+
+#define FTL_TAG_OFFSET(slot) (offsetof(pico_blockdev_ftl_header_t, slots) + (slot) * sizeof(pico_blockdev_ftl_slot_t))
+#define FTL_SEQ_OFFSET(slot) (FTL_TAG_OFFSET(slot) + offsetof(pico_blockdev_ftl_slot_t, seq))
+/* Slots whose entries fit in the header sector */
+#define FTL_MAX_SLOTS ((FTL_SECTOR_SIZE - offsetof(pico_blockdev_ftl_header_t, slots)) / sizeof(pico_blockdev_ftl_slot_t))
+
+typedef struct
+{
+    uint32_t erase_count;
+    uint32_t seq;
+    uint8_t state;
+    uint8_t valid;                 // Slots holding the current copy of a sector
+    uint8_t next;                  // Next slot to program
+} pico_blockdev_ftl_block_t;
+
+typedef struct
+{
+    struct pico_blockdev__ dev;
+    mutex_t lock;
+    pico_blockdev_flash_t *flash;
+    uint16_t num_blocks;
+    uint16_t num_free;             // Blank and free blocks
+    uint16_t gc_target;            // Free blocks background collection aims for
+    uint16_t open[2];              // Block being filled, per stream
+    uint16_t gc_victim;            // Block being collected
+    uint8_t gc_slot;               // Next slot of the victim to look at
+    uint8_t slots;                 // Data slots per erase block
+    uint32_t num_sectors;
+    uint32_t seq;
+    uint32_t wl_erases;            // Erases since static data was last moved
+    pico_blockdev_ftl_block_t *blocks;
+    uint16_t *map;                 // Logical sector to block * slots + slot
+    pico_blockdev_ftl_stats_t stats;
+    uint32_t meta[FTL_SECTOR_SIZE / sizeof(uint32_t)];
+    uint8_t buf[FTL_SECTOR_SIZE];
+} pico_blockdev_ftl_t;
+
+static int pico_blockdev_ftl_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_ftl_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_ftl_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data);
+static void pico_blockdev_ftl_destroy(pico_blockdev_t *dev);
+
+static const pico_blockdev_ops_t ftl_ops =
+{
+    .read_sector = pico_blockdev_ftl_read_sector,
+    .write_sector = pico_blockdev_ftl_write_sector,
+    .ioctl = pico_blockdev_ftl_ioctl,
+    .destroy = pico_blockdev_ftl_destroy
+};
+
+static inline pico_blockdev_ftl_header_t *pico_blockdev_ftl_meta(pico_blockdev_ftl_t *f)
+{
+    return (pico_blockdev_ftl_header_t*)f->meta;
+}
+
+static inline uint32_t pico_blockdev_ftl_block_offset(pico_blockdev_ftl_t *f, uint16_t block)
+{
+    return (uint32_t)block * f->flash->erase_size;
+}
+
+static inline uint32_t pico_blockdev_ftl_slot_offset(pico_blockdev_ftl_t *f, uint16_t slot)
+{
+    return pico_blockdev_ftl_block_offset(f, slot / f->slots) + (slot % f->slots + 1) * FTL_SECTOR_SIZE;
+}
+
+static inline bool pico_blockdev_ftl_in_range(pico_blockdev_ftl_t *f, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    return start_sector < f->num_sectors && count <= f->num_sectors - start_sector;
+}
+
+/*
+ Program bytes [start, end) of the metadata buffer into a block's header.
+ The buffer is 0xFF outside the fields being written, so the rest of the
+ program page is left as it is.
+ */
+static int pico_blockdev_ftl_program_meta(pico_blockdev_ftl_t *f, uint16_t block, unsigned start, unsigned end)
+{
+    uint32_t mask = f->flash->program_size - 1;
+
+    start &= ~mask;
+    end = (end + mask) & ~mask;
+    return f->flash->ops->program(f->flash, pico_blockdev_ftl_block_offset(f, block) + start,
+                                  (uint8_t*)f->meta + start, end - start);
+}
+
+static void pico_blockdev_ftl_map(pico_blockdev_ftl_t *f, uint32_t sector, uint16_t slot)
+{
+    uint16_t old = f->map[sector];
+
+    if (old != FTL_NONE)
+        f->blocks[old / f->slots].valid--;
+    f->map[sector] = slot;
+    if (slot != FTL_NONE)
+        f->blocks[slot / f->slots].valid++;
+}
+
+/* Erase a block and write its header. Does not touch num_free. */
+static int pico_blockdev_ftl_erase(pico_blockdev_ftl_t *f, uint16_t block)
+{
+    pico_blockdev_ftl_block_t *blk = &f->blocks[block];
+    pico_blockdev_ftl_header_t *hdr = pico_blockdev_ftl_meta(f);
+
+    blk->state = FTL_BLOCK_BLANK;
+    int r = f->flash->ops->erase(f->flash, pico_blockdev_ftl_block_offset(f, block));
+    if (r < 0)
+        return r;
+    blk->erase_count++;
+    f->stats.erases++;
+    f->wl_erases++;
+
+    memset(f->meta, 0xFF, sizeof(f->meta));
+    hdr->magic = FTL_MAGIC;
+    hdr->erase_count = blk->erase_count;
+    r = pico_blockdev_ftl_program_meta(f, block, 0, offsetof(pico_blockdev_ftl_header_t, seq));
+    if (r < 0)
+        return r;
+
+    blk->state = FTL_BLOCK_FREE;
+    blk->seq = FTL_SEQ_FREE;
+    blk->valid = 0;
+    blk->next = 0;
+    return 0;
+}
+
+/*
+ Start filling a free block. Host data goes to the least worn block;
+ collected data is likely to stay put, so it goes to the most worn one.
+ */
+static int pico_blockdev_ftl_open_block(pico_blockdev_ftl_t *f, int stream)
+{
+    pico_blockdev_ftl_header_t *hdr = pico_blockdev_ftl_meta(f);
+    uint16_t best = FTL_NONE;
+
+    for (uint16_t b = 0; b < f->num_blocks; b++) {
+        pico_blockdev_ftl_block_t *blk = &f->blocks[b];
+        if (blk->state != FTL_BLOCK_FREE && blk->state != FTL_BLOCK_BLANK)
+            continue;
+        if (best == FTL_NONE ||
+            (stream == FTL_HOT ? blk->erase_count < f->blocks[best].erase_count
+                               : blk->erase_count > f->blocks[best].erase_count))
+            best = b;
+    }
+    if (best == FTL_NONE)
+        return -ENOSPC;
+
+    pico_blockdev_ftl_block_t *blk = &f->blocks[best];
+    if (blk->state == FTL_BLOCK_BLANK) {
+        int r = pico_blockdev_ftl_erase(f, best);
+        if (r < 0)
+            return r;
+    }
+
+    memset(f->meta, 0xFF, sizeof(f->meta));
+    hdr->seq = f->seq + 1;
+    hdr->stream = stream;
+    int r = pico_blockdev_ftl_program_meta(f, best, offsetof(pico_blockdev_ftl_header_t, seq), FTL_TAG_OFFSET(0));
+    if (r < 0) {
+        blk->state = FTL_BLOCK_BLANK;
+        return r;
+    }
+
+    f->seq++;
+    blk->seq = f->seq;
+    blk->state = FTL_BLOCK_OPEN;
+    f->num_free--;
+    f->open[stream] = best;
+    return best;
+}
+
+/*
+ Append up to count sectors to the open block of a stream: data first,
+ then the slot tags, which make the copies valid. Every slot takes a new
+ sequence number: the hot and the cold stream fill their blocks at the
+ same time, so the order blocks were opened in does not tell which copy
+ of a sector is newer. Returns the number of sectors written.
+ */
+static int pico_blockdev_ftl_append(pico_blockdev_ftl_t *f, int stream, const uint8_t *data, uint32_t sector, unsigned count)
+{
+    pico_blockdev_ftl_header_t *hdr = pico_blockdev_ftl_meta(f);
+    uint16_t block = f->open[stream];
+    int r;
+
+    if (block == FTL_NONE) {
+        r = pico_blockdev_ftl_open_block(f, stream);
+        if (r < 0)
+            return r;
+        block = r;
+    }
+
+    pico_blockdev_ftl_block_t *blk = &f->blocks[block];
+    unsigned first = blk->next;
+    unsigned n = f->slots - first;
+    if (n > count)
+        n = count;
+    uint16_t slot = block * f->slots + first;
+
+    r = f->flash->ops->program(f->flash, pico_blockdev_ftl_slot_offset(f, slot), data, n * FTL_SECTOR_SIZE);
+    if (r >= 0) {
+        memset(f->meta, 0xFF, sizeof(f->meta));
+        for (unsigned i = 0; i < n; i++) {
+            hdr->slots[first + i].tag = sector + i + 1;
+            hdr->slots[first + i].seq = ++f->seq;
+        }
+        r = pico_blockdev_ftl_program_meta(f, block, FTL_TAG_OFFSET(first), FTL_TAG_OFFSET(first + n));
+    }
+
+    // Slots are used up even if programming failed half way
+    blk->next += n;
+    if (blk->next == f->slots) {
+        blk->state = FTL_BLOCK_FULL;
+        f->open[stream] = FTL_NONE;
+    }
+    if (r < 0)
+        return r;
+
+    for (unsigned i = 0; i < n; i++)
+        pico_blockdev_ftl_map(f, sector + i, slot + i);
+    return n;
+}
+
+/*
+ Choose the next block to collect. The write path only collects when it
+ runs out of spare blocks; idle time keeps gc_target blocks free and
+ erases blocks without live data ahead of time. Either way, a full block
+ whose erase count lags far behind is collected so that its static data
+ moves on, at most once per PICO_BLOCKDEV_FTL_WEAR_DELTA erases: the block
+ freed that way is the next one host data goes to.
+ */
+static bool pico_blockdev_ftl_pick_victim(pico_blockdev_ftl_t *f, bool idle)
+{
+    uint16_t greedy = FTL_NONE;
+    uint16_t coldest = FTL_NONE;
+    uint32_t max_erase = 0;
+
+    for (uint16_t b = 0; b < f->num_blocks; b++) {
+        pico_blockdev_ftl_block_t *blk = &f->blocks[b];
+        if (blk->erase_count > max_erase)
+            max_erase = blk->erase_count;
+        if (blk->state != FTL_BLOCK_FULL)
+            continue;
+        if (greedy == FTL_NONE || blk->valid < f->blocks[greedy].valid)
+            greedy = b;
+        if (coldest == FTL_NONE || blk->erase_count < f->blocks[coldest].erase_count)
+            coldest = b;
+    }
+    if (greedy == FTL_NONE)
+        return false;
+
+    uint16_t victim = FTL_NONE;
+    if (f->blocks[greedy].valid < f->slots &&
+        (f->num_free < (idle ? f->gc_target : FTL_MIN_FREE) || (idle && f->blocks[greedy].valid == 0)))
+        victim = greedy;
+    else if (f->num_free >= FTL_MIN_FREE && f->wl_erases >= PICO_BLOCKDEV_FTL_WEAR_DELTA &&
+             max_erase - f->blocks[coldest].erase_count > PICO_BLOCKDEV_FTL_WEAR_DELTA) {
+        victim = coldest;
+        f->wl_erases = 0;
+    }
+
+    if (victim == FTL_NONE)
+        return false;
+    f->gc_victim = victim;
+    f->gc_slot = 0;
+    return true;
+}
+
+/* Copy one live sector out of the victim, or erase it once none are left */
+static int pico_blockdev_ftl_gc_work(pico_blockdev_ftl_t *f)
+{
+    uint16_t victim = f->gc_victim;
+    pico_blockdev_ftl_block_t *blk = &f->blocks[victim];
+    int r;
+
+    while (f->gc_slot < f->slots && blk->valid) {
+        uint16_t slot = victim * f->slots + f->gc_slot;
+        uint32_t tag;
+
+        r = f->flash->ops->read(f->flash, pico_blockdev_ftl_block_offset(f, victim) + FTL_TAG_OFFSET(f->gc_slot),
+                                &tag, sizeof(tag));
+        if (r < 0)
+            return r;
+        if (tag == FTL_TAG_FREE || tag == FTL_TAG_DEAD || tag - 1 >= f->num_sectors || f->map[tag - 1] != slot) {
+            f->gc_slot++;
+            continue;
+        }
+
+        r = f->flash->ops->read(f->flash, pico_blockdev_ftl_slot_offset(f, slot), f->buf, FTL_SECTOR_SIZE);
+        if (r < 0)
+            return r;
+        r = pico_blockdev_ftl_append(f, FTL_COLD, f->buf, tag - 1, 1);
+        if (r < 0)
+            return r;
+        f->stats.gc_writes++;
+        f->gc_slot++;
+        return 1;
+    }
+
+    // Only stale copies left
+    r = pico_blockdev_ftl_erase(f, victim);
+    if (r < 0)
+        return r;
+    f->num_free++;
+    f->gc_victim = FTL_NONE;
+    return 1;
+}
+
+/* Called before opening a host block */
+static int pico_blockdev_ftl_make_room(pico_blockdev_ftl_t *f)
+{
+    int r;
+
+    while (f->num_free < FTL_MIN_FREE) {
+        if (f->gc_victim == FTL_NONE && !pico_blockdev_ftl_pick_victim(f, false))
+            return -ENOSPC;
+        r = pico_blockdev_ftl_gc_work(f);
+        if (r < 0)
+            return r;
+    }
+
+    // At most one block for wear leveling per host block, to bound the stall
+    if (f->gc_victim == FTL_NONE && pico_blockdev_ftl_pick_victim(f, false)) {
+        while (f->gc_victim != FTL_NONE) {
+            r = pico_blockdev_ftl_gc_work(f);
+            if (r < 0)
+                return r;
+        }
+    }
+    return 0;
+}
+
+static int pico_blockdev_ftl_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_ftl_t *f = (pico_blockdev_ftl_t*)dev;
+    unsigned i = 0;
+    int r = 0;
+
+    if (!pico_blockdev_ftl_in_range(f, start_sector, count))
+        return -EINVAL;
+
+    mutex_enter_blocking(&f->lock);
+
+    while (i < count) {
+        uint16_t slot = f->map[start_sector + i];
+
+        if (slot == FTL_NONE) {
+            memset(&data[i * FTL_SECTOR_SIZE], 0, FTL_SECTOR_SIZE);
+            i++;
+            continue;
+        }
+
+        // Sectors written together sit in consecutive slots of a block
+        unsigned run = 1;
+        while (i + run < count && f->map[start_sector + i + run] == slot + run && (slot + run) % f->slots != 0)
+            run++;
+
+        r = f->flash->ops->read(f->flash, pico_blockdev_ftl_slot_offset(f, slot), &data[i * FTL_SECTOR_SIZE], run * FTL_SECTOR_SIZE);
+        if (r < 0)
+            break;
+        i += run;
+    }
+
+    mutex_exit(&f->lock);
+
+    return r < 0 ? r : (int)count;
+}
+
+static int pico_blockdev_ftl_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_ftl_t *f = (pico_blockdev_ftl_t*)dev;
+    unsigned i = 0;
+    int r = 0;
+
+    if (!pico_blockdev_ftl_in_range(f, start_sector, count))
+        return -EINVAL;
+
+    mutex_enter_blocking(&f->lock);
+
+    while (i < count) {
+        if (f->open[FTL_HOT] == FTL_NONE) {
+            r = pico_blockdev_ftl_make_room(f);
+            if (r < 0)
+                break;
+        }
+        r = pico_blockdev_ftl_append(f, FTL_HOT, &data[i * FTL_SECTOR_SIZE], start_sector + i, count - i);
+        if (r < 0)
+            break;
+        f->stats.host_writes += r;
+        i += r;
+    }
+
+    mutex_exit(&f->lock);
+
+    return r < 0 ? r : (int)count;
+}
+
+/* Kill the current copies, one metadata program per block touched */
+static int pico_blockdev_ftl_discard(pico_blockdev_ftl_t *f, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_ftl_header_t *hdr = pico_blockdev_ftl_meta(f);
+    uint16_t block = FTL_NONE;
+    unsigned start = 0, end = 0;
+    int r = 0;
+
+    if (!pico_blockdev_ftl_in_range(f, start_sector, count))
+        return -EINVAL;
+
+    mutex_enter_blocking(&f->lock);
+
+    for (unsigned i = 0; i < count && r >= 0; i++) {
+        uint16_t slot = f->map[start_sector + i];
+        if (slot == FTL_NONE)
+            continue;
+
+        unsigned offset = FTL_TAG_OFFSET(slot % f->slots);
+        if (slot / f->slots != block) {
+            if (block != FTL_NONE)
+                r = pico_blockdev_ftl_program_meta(f, block, start, end);
+            memset(f->meta, 0xFF, sizeof(f->meta));
+            block = slot / f->slots;
+            start = offset;
+            end = offset;
+        }
+        hdr->slots[slot % f->slots].tag = FTL_TAG_DEAD;
+        if (offset < start)
+            start = offset;
+        if (offset + sizeof(uint32_t) > end)
+            end = offset + sizeof(uint32_t);
+        pico_blockdev_ftl_map(f, start_sector + i, FTL_NONE);
+    }
+    if (block != FTL_NONE && r >= 0)
+        r = pico_blockdev_ftl_program_meta(f, block, start, end);
+
+    mutex_exit(&f->lock);
+
+    return r;
+}
+
+static int pico_blockdev_ftl_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data)
+{
+    pico_blockdev_ftl_t *f = (pico_blockdev_ftl_t*)dev;
+
+    switch (cmd)
+    {
+    case PICO_IOCTL_BLKGETSIZE:
+        *(uint32_t*)data = f->num_sectors;
+        return 0;
+    case PICO_IOCTL_BLKGETSIZE64:
+        *(uint64_t*)data = (uint64_t)f->num_sectors * FTL_SECTOR_SIZE;
+        return 0;
+    case PICO_IOCTL_BLKROGET:
+        *(int*)data = 0;
+        return 0;
+    case PICO_IOCTL_BLKFLSBUF:
+        // Nothing is buffered
+        return 0;
+    case PICO_IOCTL_BLKIOOPT:
+        *(uint32_t*)data = f->slots * FTL_SECTOR_SIZE;
+        return 0;
+    case PICO_IOCTL_BLKDISCARD: {
+        pico_blockdev_range_t *range = (pico_blockdev_range_t*)data;
+        return pico_blockdev_ftl_discard(f, range->sector, range->count);
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+static void pico_blockdev_ftl_destroy(pico_blockdev_t *dev)
+{
+    pico_blockdev_ftl_t *f = (pico_blockdev_ftl_t*)dev;
+
+    free(f->map);
+    free(f->blocks);
+    free(f);
+}
+
+int pico_blockdev_ftl_gc_step(pico_blockdev_t *dev)
+{
+    pico_blockdev_ftl_t *f = (pico_blockdev_ftl_t*)dev;
+    int r = 0;
+
+    mutex_enter_blocking(&f->lock);
+    if (f->gc_victim != FTL_NONE || pico_blockdev_ftl_pick_victim(f, true))
+        r = pico_blockdev_ftl_gc_work(f);
+    mutex_exit(&f->lock);
+
+    return r;
+}
+
+void pico_blockdev_ftl_get_stats(pico_blockdev_t *dev, pico_blockdev_ftl_stats_t *stats)
+{
+    pico_blockdev_ftl_t *f = (pico_blockdev_ftl_t*)dev;
+
+    mutex_enter_blocking(&f->lock);
+    *stats = f->stats;
+    stats->free_blocks = f->num_free;
+    stats->min_erase_count = UINT32_MAX;
+    stats->max_erase_count = 0;
+    for (uint16_t b = 0; b < f->num_blocks; b++) {
+        if (f->blocks[b].erase_count < stats->min_erase_count)
+            stats->min_erase_count = f->blocks[b].erase_count;
+        if (f->blocks[b].erase_count > stats->max_erase_count)
+            stats->max_erase_count = f->blocks[b].erase_count;
+    }
+    mutex_exit(&f->lock);
+}
+
+/* Whether the data slots of a block from first on are still erased */
+static int pico_blockdev_ftl_erased(pico_blockdev_ftl_t *f, uint16_t block, unsigned first)
+{
+    for (unsigned s = first; s < f->slots; s++) {
+        int r = f->flash->ops->read(f->flash, pico_blockdev_ftl_slot_offset(f, block * f->slots + s), f->buf,
+                                    FTL_SECTOR_SIZE);
+        if (r < 0)
+            return r;
+        for (unsigned i = 0; i < FTL_SECTOR_SIZE; i++) {
+            if (f->buf[i] != 0xFF)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ Rebuild the sector map from the block headers. The newest copy of a
+ sector is the one with the highest sequence number. The newest block
+ each stream was filling is filled on: losing the cold one could leave
+ the collector without a block to copy to, if it had just taken the last
+ free one. Only when the slots after the last tagged one read back erased
+ though, otherwise a slot was cut off half programmed.
+ */
+static int pico_blockdev_ftl_mount(pico_blockdev_ftl_t *f)
+{
+    pico_blockdev_ftl_header_t *hdr = pico_blockdev_ftl_meta(f);
+    uint16_t resume[2] = { FTL_NONE, FTL_NONE };
+    uint64_t wear = 0;
+    unsigned known = 0;
+
+    for (uint16_t b = 0; b < f->num_blocks; b++) {
+        pico_blockdev_ftl_block_t *blk = &f->blocks[b];
+
+        int r = f->flash->ops->read(f->flash, pico_blockdev_ftl_block_offset(f, b), f->meta, FTL_TAG_OFFSET(f->slots));
+        if (r < 0)
+            return r;
+
+        blk->seq = FTL_SEQ_FREE;
+        if (hdr->magic != FTL_MAGIC) {
+            blk->state = FTL_BLOCK_BLANK;
+            f->num_free++;
+            continue;
+        }
+        blk->erase_count = hdr->erase_count;
+        wear += hdr->erase_count;
+        known++;
+
+        if (hdr->seq == FTL_SEQ_FREE) {
+            blk->state = FTL_BLOCK_FREE;
+            f->num_free++;
+            continue;
+        }
+        blk->state = FTL_BLOCK_FULL;
+        blk->seq = hdr->seq;
+        blk->next = 0;
+        if (hdr->seq > f->seq)
+            f->seq = hdr->seq;
+
+        for (uint8_t s = 0; s < f->slots; s++) {
+            uint32_t tag = hdr->slots[s].tag;
+            uint32_t seq = hdr->slots[s].seq;
+            if (tag != FTL_TAG_FREE || seq != FTL_SEQ_FREE)
+                blk->next = s + 1;
+            // A tag without its sequence number was cut off
+            if (tag == FTL_TAG_FREE || tag == FTL_TAG_DEAD || tag - 1 >= f->num_sectors || seq == FTL_SEQ_FREE)
+                continue;
+            if (seq > f->seq)
+                f->seq = seq;
+
+            uint16_t cur = f->map[tag - 1];
+            if (cur != FTL_NONE) {
+                uint32_t cur_seq;
+                r = f->flash->ops->read(f->flash, pico_blockdev_ftl_block_offset(f, cur / f->slots) +
+                                        FTL_SEQ_OFFSET(cur % f->slots), &cur_seq, sizeof(cur_seq));
+                if (r < 0)
+                    return r;
+                if (cur_seq > seq)
+                    continue;
+            }
+            pico_blockdev_ftl_map(f, tag - 1, b * f->slots + s);
+        }
+
+        if (blk->next < f->slots) {
+            r = pico_blockdev_ftl_erased(f, b, blk->next);
+            if (r < 0)
+                return r;
+            uint32_t stream = hdr->stream;
+            if (r > 0 && stream <= FTL_COLD &&
+                (resume[stream] == FTL_NONE || blk->seq > f->blocks[resume[stream]].seq))
+                resume[stream] = b;
+        }
+    }
+
+    for (int stream = FTL_HOT; stream <= FTL_COLD; stream++) {
+        if (resume[stream] != FTL_NONE) {
+            f->blocks[resume[stream]].state = FTL_BLOCK_OPEN;
+            f->open[stream] = resume[stream];
+        }
+    }
+    // The others are not appended to again
+    for (uint16_t b = 0; b < f->num_blocks; b++) {
+        if (f->blocks[b].state == FTL_BLOCK_FULL)
+            f->blocks[b].next = f->slots;
+    }
+
+    // Blocks without a header have lost their erase count; assume average wear
+    for (uint16_t b = 0; known && b < f->num_blocks; b++) {
+        if (f->blocks[b].state == FTL_BLOCK_BLANK)
+            f->blocks[b].erase_count = wear / known;
+    }
+    return 0;
+}
+
+pico_blockdev_t *pico_blockdev_ftl_create(pico_blockdev_flash_t *flash, unsigned reserved_blocks)
+{
+    uint32_t erase_size = flash->erase_size;
+    uint32_t program_size = flash->program_size;
+
+    if (erase_size < 1024 || erase_size > 32768 || (erase_size & (erase_size - 1)) ||
+        program_size == 0 || program_size > FTL_SECTOR_SIZE || (program_size & (program_size - 1)))
+        return NULL;
+
+    unsigned num_blocks = flash->size / erase_size;
+    unsigned slots = MIN(erase_size / FTL_SECTOR_SIZE - 1, FTL_MAX_SLOTS);
+
+    if (reserved_blocks == 0)
+        reserved_blocks = MAX(num_blocks / 16, FTL_MIN_RESERVED);
+    if (reserved_blocks < FTL_MIN_RESERVED || num_blocks <= reserved_blocks || num_blocks * slots >= FTL_NONE)
+        return NULL;
+
+    pico_blockdev_ftl_t *f = calloc(1, sizeof(pico_blockdev_ftl_t));
+    if (NULL == f)
+        return NULL;
+
+    f->flash = flash;
+    f->num_blocks = num_blocks;
+    f->slots = slots;
+    f->num_sectors = (num_blocks - reserved_blocks) * slots;
+    f->gc_target = MAX(reserved_blocks / 2, FTL_MIN_FREE + 1);
+    f->open[FTL_HOT] = FTL_NONE;
+    f->open[FTL_COLD] = FTL_NONE;
+    f->gc_victim = FTL_NONE;
+    f->blocks = calloc(num_blocks, sizeof(pico_blockdev_ftl_block_t));
+    f->map = malloc(f->num_sectors * sizeof(uint16_t));
+
+    if (!f->blocks || !f->map) {
+        free(f->map);
+        free(f->blocks);
+        free(f);
+        return NULL;
+    }
+    memset(f->map, 0xFF, f->num_sectors * sizeof(uint16_t));
+    mutex_init(&f->lock);
+
+    int r = pico_blockdev_ftl_mount(f);
+
+    pico_blockdev_init(&f->dev, &ftl_ops);
+    pico_blockdev_set_name(&f->dev, "ftl");
+    pico_blockdev_set_sector_size(&f->dev, FTL_SECTOR_SIZE);
+
+    if (r < 0) {
+        BLKDEV_ERROR(&f->dev, "Cannot read flash, error %d\n", r);
+        pico_blockdev_unref(&f->dev);
+        return NULL;
+    }
+
+    BLKDEV_INFO(&f->dev, "Flash translation layer: %u blocks, %lu sectors, %u free blocks\n",
+                num_blocks, (unsigned long)f->num_sectors, f->num_free);
+
+    return &f->dev;
+}
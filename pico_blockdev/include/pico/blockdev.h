@@ -7,19 +7,177 @@
 
 typedef struct pico_blockdev__ pico_blockdev_t;
 
+/* Use 64-bit sector numbers. Without it devices are limited to 2^32 sectors
+ (2 TiB with 512-byte sectors) but the I/O path avoids 64-bit arithmetic */
+#ifndef PICO_BLOCKDEV_LBA64
+#define PICO_BLOCKDEV_LBA64 (0)
+#endif
+
+#if PICO_BLOCKDEV_LBA64
+typedef uint64_t pico_blockdev_sector_t;
+#define PICO_BLOCKDEV_SECTOR_MAX UINT64_MAX
+#else
+typedef uint32_t pico_blockdev_sector_t;
+#define PICO_BLOCKDEV_SECTOR_MAX UINT32_MAX
+#endif
+
+/* Largest merged request issued by the I/O scheduler, in sectors. 0 disables merging */
+#ifndef PICO_BLOCKDEV_MERGE_MAX_SECTORS
+#define PICO_BLOCKDEV_MERGE_MAX_SECTORS (8)
+#endif
+
+/* Age after which queued requests are dispatched ahead of LBA order */
+#ifndef PICO_BLOCKDEV_READ_DEADLINE_US
+#define PICO_BLOCKDEV_READ_DEADLINE_US (50000)
+#endif
+
+#ifndef PICO_BLOCKDEV_WRITE_DEADLINE_US
+#define PICO_BLOCKDEV_WRITE_DEADLINE_US (500000)
+#endif
+
+/* Default largest read-ahead window when the device reports no optimal transfer size */
+#ifndef PICO_BLOCKDEV_READAHEAD_MAX_SECTORS
+#define PICO_BLOCKDEV_READAHEAD_MAX_SECTORS (16)
+#endif
+
+/* Longest device name, e.g. "sd0p1", including the terminator */
+#ifndef PICO_BLOCKDEV_NAME_MAX
+#define PICO_BLOCKDEV_NAME_MAX (16)
+#endif
+
+/* Buckets of the registry's name hash, a power of two */
+#ifndef PICO_BLOCKDEV_REGISTRY_BUCKETS
+#define PICO_BLOCKDEV_REGISTRY_BUCKETS (16)
+#endif
+
+/* Partitions allocated from a static array instead of the heap, 0 for no limit */
+#ifndef PICO_BLOCKDEV_STATIC_PARTITIONS
+#define PICO_BLOCKDEV_STATIC_PARTITIONS (0)
+#endif
+
+/* Parent to child links allocated from a static array instead of the heap, 0 for no limit */
+#ifndef PICO_BLOCKDEV_STATIC_LINKS
+#define PICO_BLOCKDEV_STATIC_LINKS (0)
+#endif
+
 typedef struct
 {
     uint32_t sector_size;
-    uint32_t total_sectors;
+    pico_blockdev_sector_t total_sectors;
 } pico_blockdev_info_t;
 
+/* Keep per-device I/O statistics (PICO_IOCTL_BLKSTATS) */
+#ifndef PICO_BLOCKDEV_STATS
+#define PICO_BLOCKDEV_STATS (1)
+#endif
+
+/* Latency histogram buckets: 0 us, then [2^(n-1), 2^n) us, the last one open ended */
+#ifndef PICO_BLOCKDEV_STATS_HIST_BUCKETS
+#define PICO_BLOCKDEV_STATS_HIST_BUCKETS (20)
+#endif
+
+typedef struct
+{
+    uint32_t ios;        // Completed requests
+    uint32_t merges;     // Requests merged with an adjacent one
+    uint32_t errors;
+    uint64_t sectors;
+    uint64_t ticks_us;   // Sum of request latencies, queueing included
+    uint32_t latency_hist[PICO_BLOCKDEV_STATS_HIST_BUCKETS];
+} pico_blockdev_io_stats_t;
+
+/*
+ Counters in the style of Linux diskstats. Requests are counted on the
+ device they were submitted to and on the device that executes them, so a
+ disk's counters include its partitions'.
+ */
+typedef struct
+{
+    pico_blockdev_io_stats_t read;
+    pico_blockdev_io_stats_t write;
+    uint32_t flushes;
+    uint64_t flush_ticks_us;
+    uint32_t in_flight;
+    uint64_t busy_us;    // Time with requests in flight
+    uint32_t busy_since; // Internal
+} pico_blockdev_stats_t;
+
+typedef struct
+{
+    uint32_t hits;       // Sectors served from the read-ahead buffer
+    uint32_t misses;     // Sequential sectors that had to be read on demand
+    uint32_t prefetches; // Prefetch requests issued
+    uint32_t wasted;     // Prefetched sectors dropped unused
+    uint16_t window;     // Current window in sectors
+    uint16_t max_window;
+} pico_blockdev_readahead_stats_t;
+
+typedef struct pico_blockdev_request pico_blockdev_request_t;
+
+/* One buffer of a vectored transfer */
+typedef struct
+{
+    void *data;
+    unsigned count;     // Sectors
+} pico_blockdev_iovec_t;
+
+/* Request flags */
+#define PICO_BLOCKDEV_REQ_SYNC (1<<0) /* Issued by a synchronous wrapper, bypasses plugging */
+#define PICO_BLOCKDEV_REQ_VECTORED (1<<1) /* Data is in iov/iovcnt, never merged */
+
+typedef void (*pico_blockdev_completion_t)(void *user, pico_blockdev_request_t *r);
+
+struct pico_blockdev_request
+{
+    pico_blockdev_sector_t start_sector;
+    unsigned sector_count;
+    bool is_write;
+    union {
+        const uint8_t *write_data;
+        uint8_t *read_data;
+        const pico_blockdev_iovec_t *iov;
+    };
+    unsigned iovcnt;
+    pico_blockdev_completion_t completion;
+    void *completion_user;
+    /* Filled in by the block layer. Status is the number of sectors
+     transferred, or a negative error */
+    int status;
+    uint32_t deadline;
+    uint8_t flags;
+    uint8_t shift;      // log2 of the caller's sector size over the executing device's
+    struct pico_blockdev__ *origin; // Device the request was submitted to
+    struct pico_blockdev_request *next;
+};
+
 typedef struct
 {
     int (*init)(pico_blockdev_t *dev);
-    int (*read_sector)(pico_blockdev_t *dev, unsigned char* data, uint32_t start_sector, unsigned count);
-    int (*write_sector)(pico_blockdev_t *dev, const unsigned char* data, uint32_t start_sector, unsigned count);
+    /* Synchronous drivers implement read_sector/write_sector */
+    int (*read_sector)(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+    int (*write_sector)(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+    /* Asynchronous drivers implement request instead. It starts the
+     transfer and returns 0; the driver later calls pico_blockdev_request_complete(),
+     possibly from IRQ context. The next queued request may be started from there. */
+    int (*request)(pico_blockdev_t *dev, pico_blockdev_request_t *request);
+    /* Optional for synchronous drivers: one sector range spread over several
+     buffers. Without them vectored I/O takes one call per buffer. */
+    int (*readv_sector)(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                        pico_blockdev_sector_t start_sector, unsigned count);
+    int (*writev_sector)(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                         pico_blockdev_sector_t start_sector, unsigned count);
+    /* Pure remapping layers (e.g. partitions) implement map instead of I/O ops.
+     It translates a range into parent sectors, or returns a negative error.
+     The range is already scaled to the parent's sector size. */
+    int (*map)(pico_blockdev_t *dev, pico_blockdev_sector_t *sector, unsigned count);
+    /* Remapping layers whose map only adds a fixed offset may also implement
+     linear: it returns that window in parent sectors. Stacks of such layers
+     are then flattened to a single translation on registration. */
+    int (*linear)(pico_blockdev_t *dev, pico_blockdev_sector_t *offset, pico_blockdev_sector_t *count);
     int (*ioctl)(pico_blockdev_t *dev, unsigned char cmd, void* data);
     void (*destroy)(pico_blockdev_t *dev);
+    /* Asynchronous drivers that handle PICO_BLOCKDEV_REQ_VECTORED requests */
+    bool request_vectored;
 } pico_blockdev_ops_t;
 
 struct pico_blockdev_link_entry
@@ -28,12 +186,56 @@ struct pico_blockdev_link_entry
     struct pico_blockdev_link_entry *next;
 };
 
+/*
+ Pending requests are kept in submission order. The scheduler dispatches
+ them in ascending LBA order (C-LOOK) unless the oldest one has passed its
+ deadline, and merges adjacent requests into a single driver call.
+ */
+typedef struct
+{
+    pico_blockdev_request_t *head;
+    pico_blockdev_request_t *tail;
+    pico_blockdev_request_t *active;
+    struct pico_blockdev_merge__ *merge; // Allocated on registration
+    pico_blockdev_sector_t position; // Sector following the last dispatched request
+    uint8_t plugged;
+    uint8_t sync_pending;
+    bool dispatching;
+} pico_blockdev_queue_t;
+
+/*
+ Translation of a remapping layer straight onto the device executing the
+ I/O, when every layer in between is linear. Computed on registration.
+ */
+typedef struct
+{
+    struct pico_blockdev__ *target; // NULL if the layers must be walked
+    pico_blockdev_sector_t offset;  // First sector, in target sectors
+    pico_blockdev_sector_t count;   // Size of the window, in target sectors
+    uint8_t shift;                  // log2 of our sector size over the target's
+} pico_blockdev_linear_t;
+
 struct pico_blockdev__
 {
     pico_object_t obj;
     const pico_blockdev_ops_t *ops;
     struct pico_blockdev__ *parent;
     struct pico_blockdev_link_entry *children;
+    pico_blockdev_queue_t queue;
+    struct pico_blockdev_readahead__ *readahead;
+    uint32_t sector_size;   // 0 until first queried
+    uint8_t sector_shift;   // Remapping layers: log2 of sector_size over the parent's
+    pico_blockdev_linear_t linear;
+    char name[PICO_BLOCKDEV_NAME_MAX]; // Base name until registration
+    struct pico_blockdev__ *hash_next; // Registry
+    struct pico_blockdev__ *list_next; // Registry, in registration order
+    uint8_t num_partitions;            // Partitions named after us so far
+    bool registered;
+    uint8_t scan_state;                // Deferred partition scan, see registry.c
+    lock_owner_id_t scan_owner;        // Core or task running the scan
+#if PICO_BLOCKDEV_STATS
+    pico_blockdev_stats_t stats; // Protected by the lock of the device executing the I/O
+#endif
     /* Other dev-specific data below */
 };
 
@@ -41,26 +243,156 @@ struct pico_blockdev__
 /*
  Supported IOCTLs
  */
-#define PICO_IOCTL_BLKGETSIZE (0)  /* Get device size in sectors */
+#define PICO_IOCTL_BLKGETSIZE (0)  /* Get device size in sectors (uint32_t), -EFBIG if it does not fit */
 #define PICO_IOCTL_BLKSSZGET (1)   /* Get sector size in bytes */
-#define PICO_IOCTL_BLKROGET (2)    /* Get readonly flag */
+#define PICO_IOCTL_BLKROGET (2)    /* Get readonly flag (int) */
 #define PICO_IOCTL_BLKFLSBUF (3)   /* Sync */
 #define PICO_IOCTL_HDIO_GETGEO (4)
+#define PICO_IOCTL_BLKRASTAT (5)   /* Get read-ahead statistics (pico_blockdev_readahead_stats_t) */
+#define PICO_IOCTL_BLKIOOPT (6)    /* Get optimal transfer size in bytes (uint32_t) */
+#define PICO_IOCTL_BLKGETSIZE64 (7) /* Get device size in bytes (uint64_t) */
+#define PICO_IOCTL_BLKDIRECT (8)    /* Get the address of memory-backed sectors (pico_blockdev_direct_t) */
+#define PICO_IOCTL_BLKSTATS (9)     /* Get I/O statistics (pico_blockdev_stats_t) */
+#define PICO_IOCTL_BLKDISCARD (10)  /* Sectors no longer in use (pico_blockdev_range_t) */
+
+typedef struct
+{
+    pico_blockdev_sector_t sector; // First sector
+    unsigned count;
+    void *addr;                    // Filled in by the driver
+} pico_blockdev_direct_t;
+
+typedef struct
+{
+    pico_blockdev_sector_t sector; // First sector
+    unsigned count;
+} pico_blockdev_range_t;
 
 /* Returns number of sectors read */
-int pico_blockdev_read_sector(pico_blockdev_t *dev, unsigned char* data, uint32_t start_sector, unsigned count);
+int pico_blockdev_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
 /* Returns number of sectors written */
-int pico_blockdev_write_sector(pico_blockdev_t *dev, const unsigned char* data, uint32_t start_sector, unsigned count);
+int pico_blockdev_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+/*
+ Vectored I/O: the buffers in iov are transferred to or from consecutive
+ sectors starting at start_sector, as a single request when the driver
+ supports it. Returns the number of sectors transferred.
+ */
+int pico_blockdev_readv_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                               pico_blockdev_sector_t start_sector);
+int pico_blockdev_writev_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                pico_blockdev_sector_t start_sector);
+
+/*
+ Queue a request. Returns 0 if queued, in which case the completion is
+ called exactly once, possibly before this function returns and possibly
+ from IRQ context. On error the completion is not called.
+ Remapping layers rewrite start_sector and sector_count while the request
+ is in flight; status is in the caller's sectors.
+ Do not issue synchronous I/O on the same device from a completion.
+ */
+int pico_blockdev_submit(pico_blockdev_t *dev, pico_blockdev_request_t *req);
+int pico_blockdev_read_sector_async(pico_blockdev_t *dev, pico_blockdev_request_t *req,
+                                    unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count,
+                                    pico_blockdev_completion_t completion, void *user);
+int pico_blockdev_write_sector_async(pico_blockdev_t *dev, pico_blockdev_request_t *req,
+                                     const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count,
+                                     pico_blockdev_completion_t completion, void *user);
+/* Called by asynchronous drivers when a request finishes. IRQ safe. */
+void pico_blockdev_request_complete(pico_blockdev_t *dev, pico_blockdev_request_t *req, int status);
+
+/*
+ While plugged, requests accumulate in the queue so they can be sorted and
+ merged; unplugging dispatches them. Synchronous I/O dispatches regardless.
+ Plugs nest.
+ */
+void pico_blockdev_plug(pico_blockdev_t *dev);
+void pico_blockdev_unplug(pico_blockdev_t *dev);
+/*
+ Enable sequential read-ahead on the device that executes I/O for dev.
+ The window adapts between a few sectors and max_sectors; 0 sizes it from
+ PICO_IOCTL_BLKIOOPT. Enable and disable while the device is idle.
+ */
+int pico_blockdev_readahead_enable(pico_blockdev_t *dev, unsigned max_sectors);
+void pico_blockdev_readahead_disable(pico_blockdev_t *dev);
+
 int pico_blockdev_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data);
+/*
+ Device size in sectors. Uses PICO_IOCTL_BLKGETSIZE64 when the driver
+ implements it, PICO_IOCTL_BLKGETSIZE otherwise.
+ */
+int pico_blockdev_get_sectors(pico_blockdev_t *dev, pico_blockdev_sector_t *sectors);
+/*
+ Logical sector size, from PICO_IOCTL_BLKSSZGET on first use (512 if the
+ driver does not say). PICO_IOCTL_BLKSSZGET itself answers from here.
+ */
+uint32_t pico_blockdev_get_sector_size(pico_blockdev_t *dev);
+/*
+ Drivers may set their sector size instead of implementing PICO_IOCTL_BLKSSZGET.
+ Remapping layers may expose a power of two multiple of their parent's
+ size, so that e.g. a partition of a 512-byte device does 4K I/O. Set it
+ while the device is idle.
+ */
+int pico_blockdev_set_sector_size(pico_blockdev_t *dev, uint32_t sector_size);
+/*
+ Address of a sector range when the device underneath dev is memory-backed
+ and the range is contiguous in memory, NULL otherwise. Accesses through
+ the pointer bypass the request queue; read-ahead for the range is dropped.
+ */
+void *pico_blockdev_direct_access(pico_blockdev_t *dev, pico_blockdev_sector_t sector, unsigned count);
+/*
+ Tell the device underneath dev that a sector range no longer holds useful
+ data, so flash can erase it ahead of time instead of copying it during
+ garbage collection. Afterwards the range reads back as zeroes or as
+ stale data. Not ordered against queued asynchronous writes to the range.
+ The hint is advisory: drivers that do not implement it fail the ioctl.
+ */
+int pico_blockdev_discard(pico_blockdev_t *dev, pico_blockdev_sector_t sector, unsigned count);
 int pico_blockdev_init(pico_blockdev_t *dev, const pico_blockdev_ops_t *ops);
 bool pico_blockdev_has_children(pico_blockdev_t *dev);
 
 int pico_blockdev_register(pico_blockdev_t *dev);
 void pico_blockdev_unregister(pico_blockdev_t *dev);
+/*
+ Register without scanning for partitions, so that boot does not wait for
+ the first read of a slow device. The scan runs on first access to the
+ children (pico_blockdev_next_child(), or a lookup of a partition name),
+ on pico_blockdev_scan(), or from a worker calling
+ pico_blockdev_scan_pending(). Partitions then register as usual and
+ show up through the register event.
+ */
+int pico_blockdev_register_deferred(pico_blockdev_t *dev);
+/*
+ Run dev's deferred scan if it has not run yet. If the other core is
+ running it, wait for it to finish.
+ */
+void pico_blockdev_scan(pico_blockdev_t *dev);
+/* Run the oldest deferred scan. Returns false when none was left */
+bool pico_blockdev_scan_pending(void);
 
 void pico_blockdev_register_event(pico_blockdev_t *dev);
 void pico_blockdev_unregister_event(pico_blockdev_t *dev);
 
+/*
+ Registered devices are named after a base set by the driver ("blk" if
+ none) and the first free number, e.g. "sd0". Partitions are named after
+ their parent and their number, e.g. "sd0p1". The registry holds a
+ reference until the device is unregistered.
+ */
+int pico_blockdev_set_name(pico_blockdev_t *dev, const char *base);
+const char *pico_blockdev_get_name(pico_blockdev_t *dev);
+/* Registered device called name, with a new reference, or NULL */
+pico_blockdev_t *pico_blockdev_lookup(const char *name);
+/*
+ Walk the registered devices in registration order, or the children of
+ dev. Each call returns a new reference to the device after prev (the
+ first one for NULL) and drops the reference to prev. A walk of the
+ registry goes on past devices unregistered meanwhile; a walk of the
+ children ends early if prev is removed. When stopping early, unref the
+ last device returned.
+ */
+pico_blockdev_t *pico_blockdev_next(pico_blockdev_t *prev);
+pico_blockdev_t *pico_blockdev_next_child(pico_blockdev_t *dev, pico_blockdev_t *prev);
+
 /*static inline void pico_blockdev_set_parent(pico_blockdev_t *child, pico_blockdev_t *parent)
 {
     pico_object_ref(&parent->obj);
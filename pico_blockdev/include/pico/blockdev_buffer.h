@@ -0,0 +1,51 @@
+#ifndef BLOCKDEV_BUFFER_H__
+#define BLOCKDEV_BUFFER_H__
+
+#include "pico/blockdev.h"
+
+/*
+ Pool of sector buffers to borrow for I/O instead of allocating them.
+
+ Buffers are grouped in classes by sector size; registering a device
+ sets up the class for its sector size with PICO_BLOCKDEV_BUFFER_RESERVE
+ buffers. Get and put are a list operation under a critical section and
+ may be called from IRQ context as long as the class does not run dry:
+ a get on an empty class allocates, and the buffer joins the pool when
+ it is put back.
+ */
+
+/* Alignment of pool buffers; 4 covers 32-bit DMA transfers */
+#ifndef PICO_BLOCKDEV_BUFFER_ALIGN
+#define PICO_BLOCKDEV_BUFFER_ALIGN 4
+#endif
+
+/* Distinct sector sizes the pool keeps buffers for */
+#ifndef PICO_BLOCKDEV_BUFFER_CLASSES
+#define PICO_BLOCKDEV_BUFFER_CLASSES 4
+#endif
+
+/* Buffers allocated when a device registers, shared by devices of the same sector size */
+#ifndef PICO_BLOCKDEV_BUFFER_RESERVE
+#define PICO_BLOCKDEV_BUFFER_RESERVE 2
+#endif
+
+typedef struct
+{
+    uint32_t size;          // Buffer size in bytes
+    uint16_t total;         // Buffers owned by the class
+    uint16_t in_use;
+    uint16_t high_water;    // Most buffers in use at once
+    uint32_t gets;
+    uint32_t misses;        // Gets that had to allocate
+} pico_blockdev_buffer_stats_t;
+
+/* One sector of dev, aligned to PICO_BLOCKDEV_BUFFER_ALIGN. NULL if out of memory */
+void *pico_blockdev_buffer_get(pico_blockdev_t *dev);
+/* Return a buffer from pico_blockdev_buffer_get(). NULL is ignored */
+void pico_blockdev_buffer_put(void *buf);
+/* Make sure count buffers of dev's sector size exist. Returns 0 or a negative error */
+int pico_blockdev_buffer_reserve(pico_blockdev_t *dev, unsigned count);
+/* Statistics of the class for dev's sector size, -ENOENT if there is none */
+int pico_blockdev_buffer_get_stats(pico_blockdev_t *dev, pico_blockdev_buffer_stats_t *stats);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef BLOCKDEV_CACHE_H__
+#define BLOCKDEV_CACHE_H__
+
+#include "pico/blockdev.h"
+
+/*
+ Write-back LRU sector cache.
+
+ The cache is a stackable block device: it is added as a child of the
+ device it caches, and partitions are scanned on the cache instead of on
+ the underlying device. Create the cache before registering the parent,
+ then register both.
+ */
+
+typedef struct
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writebacks;
+    uint32_t evictions;
+} pico_blockdev_cache_stats_t;
+
+/* Returns a new cache device holding up to num_sectors sectors, or NULL */
+pico_blockdev_t *pico_blockdev_cache_create(pico_blockdev_t *parent, unsigned num_sectors);
+/* Writes back all dirty sectors. Returns 0 or a negative error */
+int pico_blockdev_cache_flush(pico_blockdev_t *dev);
+void pico_blockdev_cache_get_stats(pico_blockdev_t *dev, pico_blockdev_cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef BLOCKDEV_COALESCE_H__
+#define BLOCKDEV_COALESCE_H__
+
+#include "pico/blockdev.h"
+
+/*
+ Write coalescing for flash-backed devices.
+
+ Small writes are staged in buffers of one erase block each, and reach
+ the parent as a single write of the whole aligned block: when the block
+ fills up, when the buffer is needed for another block, when it has been
+ staged for longer than the timeout, or on PICO_IOCTL_BLKFLSBUF. Sectors
+ of a partly written block are read back from the parent first. Writes
+ that cover whole blocks go straight through. Reads see staged data.
+
+ Stacks like the cache: it becomes a child of the parent, and partitions
+ are scanned on it. Create it before registering the parent, then
+ register both.
+ */
+
+typedef struct
+{
+    uint32_t staged;            // Sectors written into a staging buffer
+    uint32_t direct;            // Sectors written through as whole blocks
+    uint32_t full_flushes;      // Blocks flushed as written
+    uint32_t partial_flushes;   // Blocks completed from the parent first
+    uint32_t fill_sectors;      // Sectors read for partial flushes
+    uint32_t split_flushes;     // Blocks written in pieces around discarded sectors
+    uint32_t timeouts;          // Flushes because of the timeout
+} pico_blockdev_coalesce_stats_t;
+
+/*
+ Returns a new coalescing device, or NULL. block_sectors is the erase block
+ size in parent sectors, 0 to use PICO_IOCTL_BLKIOOPT (4K if unknown).
+ Staged data is flushed after timeout_ms, 0 for no timeout. The timeout is
+ checked on each I/O and by pico_blockdev_coalesce_poll().
+ */
+pico_blockdev_t *pico_blockdev_coalesce_create(pico_blockdev_t *parent, unsigned block_sectors,
+                                               unsigned num_buffers, uint32_t timeout_ms);
+/* Writes out all staged blocks. Returns 0 or a negative error */
+int pico_blockdev_coalesce_flush(pico_blockdev_t *dev);
+/* Writes out the blocks that have timed out; call it periodically when idle */
+int pico_blockdev_coalesce_poll(pico_blockdev_t *dev);
+void pico_blockdev_coalesce_get_stats(pico_blockdev_t *dev, pico_blockdev_coalesce_stats_t *stats);
+
+#endif
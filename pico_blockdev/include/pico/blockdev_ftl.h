@@ -0,0 +1,91 @@
+#ifndef BLOCKDEV_FTL_H__
+#define BLOCKDEV_FTL_H__
+
+#include "pico/blockdev.h"
+
+/*
+ Flash translation layer: a 512-byte sector device on top of raw NOR flash.
+
+ Writes are appended to a log instead of erasing and rewriting a whole
+ erase block per sector. Each erase block holds a metadata sector (erase
+ count, owner and sequence number of each slot) followed by data slots,
+ and the sector map is rebuilt from the metadata when the device is
+ created.
+
+ - Host writes and garbage collection copies go to separate open blocks,
+   so rewritten (hot) data does not keep moving static (cold) data.
+ - Free blocks are handed out least worn first. When the erase counts
+   drift apart, the full block with the least wear is collected as well
+   so the static data it holds moves to a worn block.
+ - Garbage collection picks the block with the fewest live sectors. It
+   runs in the write path only when free blocks run out; call
+   pico_blockdev_ftl_gc_step() when idle to keep spare blocks ready.
+
+ A discard marks the sectors dead on flash. After a power cut, an older
+ copy of a discarded sector may read back instead of zeroes.
+ */
+
+/* Erase count spread that triggers static wear leveling, and erases between two such moves */
+#ifndef PICO_BLOCKDEV_FTL_WEAR_DELTA
+#define PICO_BLOCKDEV_FTL_WEAR_DELTA 16
+#endif
+
+typedef struct pico_blockdev_flash pico_blockdev_flash_t;
+
+/*
+ Raw flash access. Offsets are relative to the start of the region.
+ program() gets whole program pages and may only clear bits; erase()
+ erases one erase block. All return 0 or a negative error.
+ */
+typedef struct
+{
+    int (*read)(pico_blockdev_flash_t *flash, uint32_t offset, void *data, uint32_t len);
+    int (*program)(pico_blockdev_flash_t *flash, uint32_t offset, const void *data, uint32_t len);
+    int (*erase)(pico_blockdev_flash_t *flash, uint32_t offset);
+} pico_blockdev_flash_ops_t;
+
+struct pico_blockdev_flash
+{
+    const pico_blockdev_flash_ops_t *ops;
+    uint32_t size;          // Region size in bytes
+    uint32_t erase_size;    // Power of two, 1K to 32K
+    uint32_t program_size;  // Power of two, up to 512
+};
+
+typedef struct
+{
+    uint64_t host_writes;   // Sectors written through the device
+    uint64_t gc_writes;     // Sectors copied by garbage collection
+    uint32_t erases;
+    uint32_t free_blocks;
+    uint32_t min_erase_count;
+    uint32_t max_erase_count;
+} pico_blockdev_ftl_stats_t;
+
+/*
+ Returns a new FTL device over flash, or NULL. reserved_blocks erase blocks
+ are kept back from the capacity for garbage collection (at least 4, 0 for
+ about 1/16 of the flash); more spare space lowers write amplification.
+ Blank or foreign blocks are erased on first use. The flash must outlive
+ the device.
+ */
+pico_blockdev_t *pico_blockdev_ftl_create(pico_blockdev_flash_t *flash, unsigned reserved_blocks);
+/*
+ Do a bounded amount of background work: copy one live sector out of the
+ block being collected, or erase it. Returns 1 if there was work, 0 once
+ enough blocks are free and wear is even, or a negative error.
+ */
+int pico_blockdev_ftl_gc_step(pico_blockdev_t *dev);
+void pico_blockdev_ftl_get_stats(pico_blockdev_t *dev, pico_blockdev_ftl_stats_t *stats);
+
+/*
+ The RP2040's own QSPI flash, from offset (relative to the start of flash)
+ for size bytes; both must be multiples of FLASH_SECTOR_SIZE. Program and
+ erase run through flash_safe_execute(), so the other core must have
+ called flash_safe_execute_core_init() if it runs (the FreeRTOS SMP port
+ does without). Data to program may live in flash. Link
+ pico_blockdev_flash_rp2040.
+ */
+pico_blockdev_flash_t *pico_blockdev_flash_rp2040_create(uint32_t offset, uint32_t size);
+
+#endif
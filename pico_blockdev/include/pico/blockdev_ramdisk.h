@@ -0,0 +1,22 @@
+#ifndef BLOCKDEV_RAMDISK_H__
+#define BLOCKDEV_RAMDISK_H__
+
+#include "pico/blockdev.h"
+
+/*
+ Block device backed by a memory region.
+
+ I/O completes synchronously with a memcpy, and the device answers
+ PICO_IOCTL_BLKDIRECT so upper layers can access sectors in place with
+ pico_blockdev_direct_access(). Discarded sectors read back as zeroes.
+ Register it like any other device.
+ */
+
+/*
+ Returns a new RAM disk of size / sector_size sectors over mem, or NULL.
+ If mem is NULL the memory is allocated (zeroed) and freed with the device,
+ otherwise it must outlive the device.
+ */
+pico_blockdev_t *pico_blockdev_ramdisk_create(void *mem, size_t size, uint32_t sector_size, bool readonly);
+
+#endif
@@ -1,4 +1,6 @@
 #include "pico/blockdev.h"
+#include "pico/blockdev_buffer.h"
+#include "pico/object_slab.h"
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -16,24 +18,97 @@ struct msdos_partition {
     uint8_t nr_sects[4];
 } __attribute__((packed));
 
+#define MSDOS_SYS_IND_GPT (0xEE)
+#define MSDOS_SYS_IND_EXTENDED (0x05)
+#define MSDOS_SYS_IND_EXTENDED_LBA (0x0F)
+#define MSDOS_SYS_IND_EXTENDED_LINUX (0x85)
+
+/* Bound on the EBR chain walk, also used to detect loops */
+#ifndef PICO_BLOCKDEV_MAX_LOGICAL_PARTITIONS
+#define PICO_BLOCKDEV_MAX_LOGICAL_PARTITIONS (32)
+#endif
+
+/* Largest read while walking closely spaced EBRs, in 512-byte units */
+#ifndef PICO_BLOCKDEV_EBR_READ_SECTORS
+#define PICO_BLOCKDEV_EBR_READ_SECTORS (8)
+#endif
+
+struct gpt_header {
+    uint8_t signature[8];
+    uint8_t revision[4];
+    uint8_t header_size[4];
+    uint8_t header_crc32[4];
+    uint8_t reserved[4];
+    uint8_t my_lba[8];
+    uint8_t alternate_lba[8];
+    uint8_t first_usable_lba[8];
+    uint8_t last_usable_lba[8];
+    uint8_t disk_guid[16];
+    uint8_t partition_entry_lba[8];
+    uint8_t num_partition_entries[4];
+    uint8_t sizeof_partition_entry[4];
+    uint8_t partition_entry_array_crc32[4];
+} __attribute__((packed));
+
+struct gpt_entry {
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint8_t first_lba[8];
+    uint8_t last_lba[8];
+    uint8_t attributes[8];
+    uint8_t name[72];
+} __attribute__((packed));
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_MIN_SIZE (92)
+#define GPT_ENTRY_MIN_SIZE (128)
+#define GPT_MAX_ENTRIES (1024)
+
+/* Largest single read of the GPT entry array, in 512-byte units. 32 covers the usual 128 entries */
+#ifndef PICO_BLOCKDEV_GPT_READ_SECTORS
+#define PICO_BLOCKDEV_GPT_READ_SECTORS (32)
+#endif
+
+#ifndef PICO_BLOCKDEV_GPT_MAX_PARTITIONS
+#define PICO_BLOCKDEV_GPT_MAX_PARTITIONS (16)
+#endif
+
+typedef struct
+{
+    uint64_t first_usable;
+    uint64_t last_usable;
+    uint64_t entry_lba;
+    uint32_t num_entries;
+    uint32_t entry_size;
+    uint32_t entries_crc;
+} gpt_info_t;
+
+typedef struct
+{
+    pico_blockdev_sector_t start;
+    pico_blockdev_sector_t size;
+} gpt_found_t;
+
 
 typedef struct pico_blockdev_part__
 {
     struct pico_blockdev__ dev;
-    uint32_t start_sector;
-    uint32_t num_sectors;
+    pico_blockdev_sector_t start_sector;
+    pico_blockdev_sector_t num_sectors;
 } pico_blockdev_part_t;
 
+PICO_OBJECT_CACHE_DEFINE(part_cache, pico_blockdev_part_t, PICO_BLOCKDEV_STATIC_PARTITIONS);
 
-static int pico_blockdev_part_read_sector(pico_blockdev_t *dev, unsigned char* data, uint32_t start_sector, unsigned count);
-static int pico_blockdev_part_write_sector(pico_blockdev_t *dev, const unsigned char* data, uint32_t start_sector, unsigned count);
+
+static int pico_blockdev_part_map(pico_blockdev_t *dev, pico_blockdev_sector_t *sector, unsigned count);
+static int pico_blockdev_part_linear(pico_blockdev_t *dev, pico_blockdev_sector_t *offset, pico_blockdev_sector_t *count);
 static int pico_blockdev_part_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data);
 static void pico_blockdev_part_destroy(pico_blockdev_t *dev);
 
 static const pico_blockdev_ops_t part_ops =
 {
-    .read_sector = pico_blockdev_part_read_sector,
-    .write_sector = pico_blockdev_part_write_sector,
+    .map = pico_blockdev_part_map,
+    .linear = pico_blockdev_part_linear,
     .ioctl = pico_blockdev_part_ioctl,
     .destroy = pico_blockdev_part_destroy
 };
@@ -42,23 +117,27 @@ static void pico_blockdev_part_destroy(pico_blockdev_t *dev)
 {
     if (dev->parent)
         pico_blockdev_unref(dev->parent);
-    free(dev);
+    pico_object_cache_free(&part_cache, dev);
 }
 
-static int pico_blockdev_part_read_sector(pico_blockdev_t *dev, unsigned char* data, uint32_t start_sector, unsigned count)
+static int pico_blockdev_part_map(pico_blockdev_t *dev, pico_blockdev_sector_t *sector, unsigned count)
 {
     pico_blockdev_part_t *d = (pico_blockdev_part_t*)dev;
-    if (d->dev.parent->ops->read_sector)
-        return d->dev.parent->ops->read_sector(d->dev.parent, data, start_sector + d->start_sector, count);
-    return -ENOSYS;
+
+    if (*sector >= d->num_sectors || count > d->num_sectors - *sector)
+        return -EINVAL;
+
+    *sector += d->start_sector;
+    return 0;
 }
 
-static int pico_blockdev_part_write_sector(pico_blockdev_t *dev, const unsigned char* data, uint32_t start_sector, unsigned count)
+static int pico_blockdev_part_linear(pico_blockdev_t *dev, pico_blockdev_sector_t *offset, pico_blockdev_sector_t *count)
 {
     pico_blockdev_part_t *d = (pico_blockdev_part_t*)dev;
-    if (d->dev.parent->ops->write_sector)
-        return d->dev.parent->ops->write_sector(d->dev.parent, data, start_sector + d->start_sector, count);
-    return -ENOSYS;
+
+    *offset = d->start_sector;
+    *count = d->num_sectors;
+    return 0;
 }
 
 static int pico_blockdev_part_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data)
@@ -69,7 +148,16 @@ static int pico_blockdev_part_ioctl(pico_blockdev_t *dev, unsigned char cmd, voi
     switch (cmd)
     {
     case PICO_IOCTL_BLKGETSIZE:
-        *(uint32_t*)data = d->num_sectors;
+        // In units of our own sector size, which may be larger than the parent's
+        if ((d->num_sectors >> dev->sector_shift) > UINT32_MAX) {
+            r = -EFBIG;
+            break;
+        }
+        *(uint32_t*)data = d->num_sectors >> dev->sector_shift;
+        r = 0;
+        break;
+    case PICO_IOCTL_BLKGETSIZE64:
+        *(uint64_t*)data = (uint64_t)d->num_sectors * pico_blockdev_get_sector_size(d->dev.parent);
         r = 0;
         break;
     default:
@@ -89,6 +177,147 @@ static uint32_t pico_blockdev_extractle32(const uint8_t *src)
     return v;
 }
 
+static uint64_t pico_blockdev_extractle64(const uint8_t *src)
+{
+    return pico_blockdev_extractle32(src) | ((uint64_t)pico_blockdev_extractle32(&src[4]) << 32);
+}
+
+static uint32_t pico_blockdev_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+static void pico_blockdev_add_partition(pico_blockdev_t *dev, pico_blockdev_sector_t start, pico_blockdev_sector_t size)
+{
+    // Allocate new blockdev
+    pico_blockdev_part_t *newdev = pico_object_cache_alloc(&part_cache);
+    if (NULL == newdev) {
+        BLKDEV_ERROR(dev, "Cannot add partition, out of memory\n");
+        return;
+    }
+    pico_blockdev_init(&newdev->dev, &part_ops);
+    pico_object_set_type(&newdev->dev.obj, "part");
+    newdev->num_sectors = size;
+    newdev->start_sector = start;
+
+    int r =pico_blockdev_add_child(dev, &newdev->dev);
+    if (r==0)
+    {
+
+        BLKDEV_INFO(dev, "New partition found start %llu sectors=%llu\n",
+                    (unsigned long long)start, (unsigned long long)size);
+
+        pico_blockdev_register((pico_blockdev_t*)newdev);
+    } else
+    {
+        BLKDEV_ERROR(dev, "Cannot add partition, err %d %s\n", r, strerror(-r));
+        pico_blockdev_unref(&newdev->dev);
+    }
+}
+
+static inline bool pico_blockdev_is_extended(uint8_t sys_ind)
+{
+    return sys_ind == MSDOS_SYS_IND_EXTENDED ||
+        sys_ind == MSDOS_SYS_IND_EXTENDED_LBA ||
+        sys_ind == MSDOS_SYS_IND_EXTENDED_LINUX;
+}
+
+/*
+ Walk the EBR chain of an extended partition. Logical partitions are
+ relative to their EBR, links to the next EBR are relative to the start
+ of the extended partition. The chain is bounded in length, must stay
+ inside the extended partition and must not revisit an EBR.
+
+ Each EBR usually sits right before its logical partition, so the next
+ one is a partition length further on. When the last step was shorter
+ than PICO_BLOCKDEV_EBR_READ_SECTORS, the following EBRs are assumed to
+ be as close and read together with the current one, so chains of small
+ partitions take a few large reads.
+ */
+static void pico_blockdev_scan_extended(pico_blockdev_t *dev, uint32_t ext_start, uint32_t ext_size)
+{
+    uint32_t sector_size = pico_blockdev_get_sector_size(dev);
+    pico_blockdev_sector_t visited[PICO_BLOCKDEV_MAX_LOGICAL_PARTITIONS];
+    unsigned max_batch = MAX(PICO_BLOCKDEV_EBR_READ_SECTORS * 512 / sector_size, 1);
+    pico_blockdev_sector_t step = 0;
+    pico_blockdev_sector_t win_start = 0;
+    unsigned win_count = 0;
+    pico_blockdev_sector_t ebr = ext_start;
+    uint8_t *buf;
+
+    while (NULL == (buf = malloc(max_batch * sector_size))) {
+        if (max_batch == 1) {
+            BLKDEV_ERROR(dev, "Cannot scan extended partition, out of memory\n");
+            return;
+        }
+        max_batch /= 2;
+    }
+
+    for (unsigned n = 0; n < PICO_BLOCKDEV_MAX_LOGICAL_PARTITIONS; n++) {
+        if (ebr < ext_start || ebr - ext_start >= ext_size) {
+            BLKDEV_WARN(dev, "EBR outside extended partition\n");
+            break;
+        }
+        for (unsigned i = 0; i < n; i++) {
+            if (visited[i] == ebr) {
+                BLKDEV_ERROR(dev, "Loop in extended partition chain\n");
+                goto out;
+            }
+        }
+        visited[n] = ebr;
+
+        if (ebr < win_start || ebr - win_start >= win_count) {
+            unsigned count = step > 0 && step < max_batch ? max_batch : 1;
+            count = MIN(count, (pico_blockdev_sector_t)ext_start + ext_size - ebr);
+            int r = pico_blockdev_read_sector(dev, buf, ebr, count);
+            if (r != (int)count) {
+                BLKDEV_ERROR(dev, "Cannot read EBR, error %d\n", r);
+                break;
+            }
+            win_start = ebr;
+            win_count = count;
+        }
+
+        const uint8_t *sect = &buf[(ebr - win_start) * sector_size];
+        if (sect[510] != 0x55 || sect[511] != 0xAA)
+            break;
+
+        const struct msdos_partition *logical = (const struct msdos_partition*)&sect[0x1be];
+        const struct msdos_partition *link = logical + 1;
+
+        if (logical->sys_ind != 0x0 && !pico_blockdev_is_extended(logical->sys_ind)) {
+            pico_blockdev_sector_t start = ebr + pico_blockdev_extractle32(logical->start_sect);
+            uint32_t size = pico_blockdev_extractle32(logical->nr_sects);
+
+            if (start >= ebr && start - ext_start < ext_size && size <= ext_size - (start - ext_start)) {
+                pico_blockdev_add_partition(dev, start, size);
+            } else {
+                BLKDEV_WARN(dev, "Logical partition outside extended partition\n");
+            }
+        }
+
+        if (!pico_blockdev_is_extended(link->sys_ind))
+            break;
+
+        pico_blockdev_sector_t next = (pico_blockdev_sector_t)ext_start + pico_blockdev_extractle32(link->start_sect);
+        step = next > ebr ? next - ebr : 0;
+        ebr = next;
+    }
+out:
+    free(buf);
+}
+
 static void pico_blockdev_check_msdos_partition(pico_blockdev_t *dev, uint8_t *source, int index)
 {
     struct msdos_partition *p = (struct msdos_partition*)(&source[ index * sizeof(struct msdos_partition) ] );
@@ -97,41 +326,235 @@ static void pico_blockdev_check_msdos_partition(pico_blockdev_t *dev, uint8_t *s
     {
         uint32_t start = pico_blockdev_extractle32(p->start_sect);
         uint32_t size = pico_blockdev_extractle32(p->nr_sects);
-        // Allocate new blockdev
-        pico_blockdev_part_t *newdev = malloc(sizeof(pico_blockdev_part_t));
-        pico_blockdev_init(&newdev->dev, &part_ops);
-        newdev->num_sectors = size;
-        newdev->start_sector = start;
-
-        int r =pico_blockdev_add_child(dev, &newdev->dev);
-        if (r==0)
-        {
 
-            BLKDEV_INFO(dev, "New partition found start %d sectors=%d\n", start, size);
+        if (pico_blockdev_is_extended(p->sys_ind))
+            pico_blockdev_scan_extended(dev, start, size);
+        else
+            pico_blockdev_add_partition(dev, start, size);
+    }
+}
 
-            pico_blockdev_register((pico_blockdev_t*)newdev);
-        } else
-        {
-            BLKDEV_ERROR(dev, "Cannot add partition, err %d %s\n", r, strerror(-r));
+static bool pico_blockdev_is_protective_mbr(const uint8_t *source)
+{
+    for (int i=0; i<4; i++) {
+        const struct msdos_partition *p = (const struct msdos_partition*)(&source[ i * sizeof(struct msdos_partition) ] );
+        if (p->sys_ind == MSDOS_SYS_IND_GPT)
+            return true;
+    }
+    return false;
+}
+
+/*
+ Validate a GPT header read from "lba". The header CRC field is cleared
+ in the buffer while checking.
+ */
+static bool pico_blockdev_parse_gpt_header(uint8_t *sect, uint32_t sector_size, uint64_t lba, gpt_info_t *info)
+{
+    struct gpt_header *h = (struct gpt_header*)sect;
+    uint32_t header_size = pico_blockdev_extractle32(h->header_size);
+
+    if (memcmp(h->signature, GPT_SIGNATURE, sizeof(h->signature)) != 0)
+        return false;
+
+    if (header_size < GPT_HEADER_MIN_SIZE || header_size > sector_size)
+        return false;
+
+    uint32_t crc = pico_blockdev_extractle32(h->header_crc32);
+    memset(h->header_crc32, 0, sizeof(h->header_crc32));
+    if (pico_blockdev_crc32(0, sect, header_size) != crc)
+        return false;
+
+    if (pico_blockdev_extractle64(h->my_lba) != lba)
+        return false;
+
+    info->first_usable = pico_blockdev_extractle64(h->first_usable_lba);
+    info->last_usable = pico_blockdev_extractle64(h->last_usable_lba);
+    info->entry_lba = pico_blockdev_extractle64(h->partition_entry_lba);
+    info->num_entries = pico_blockdev_extractle32(h->num_partition_entries);
+    info->entry_size = pico_blockdev_extractle32(h->sizeof_partition_entry);
+    info->entries_crc = pico_blockdev_extractle32(h->partition_entry_array_crc32);
+
+    // Entries are 128 * 2^n bytes; we also need them not to straddle sectors
+    if (info->entry_size < GPT_ENTRY_MIN_SIZE || info->entry_size > sector_size ||
+        (info->entry_size & (info->entry_size - 1)) != 0)
+        return false;
+
+    if (info->num_entries == 0 || info->num_entries > GPT_MAX_ENTRIES)
+        return false;
+
+    if (info->first_usable > info->last_usable)
+        return false;
+
+    return true;
+}
+
+/*
+ Read the entry array of a header in chunks of up to
+ PICO_BLOCKDEV_GPT_READ_SECTORS sectors. Entries must lie within the
+ usable range of the header and on the device. Returns -EBADMSG if the
+ array does not match its CRC.
+ */
+static int pico_blockdev_read_gpt_entries(pico_blockdev_t *dev, uint8_t *sect, const gpt_info_t *info,
+                                          pico_blockdev_sector_t total_sectors, gpt_found_t *found, unsigned *nfound)
+{
+    uint32_t sector_size = pico_blockdev_get_sector_size(dev);
+    uint32_t remaining = info->num_entries * info->entry_size;
+    uint32_t sectors = (remaining + sector_size - 1) / sector_size;
+    unsigned chunk = MIN(sectors, MAX(PICO_BLOCKDEV_GPT_READ_SECTORS * 512 / sector_size, 1));
+    uint8_t *buf = NULL;
+
+    while (chunk > 1 && NULL == (buf = malloc(chunk * sector_size)))
+        chunk /= 2;
+
+    if (NULL == buf) {
+        buf = sect;
+        chunk = 1;
+    }
+
+    uint64_t lba = info->entry_lba;
+    uint32_t crc = 0;
+    int r = 0;
+
+    *nfound = 0;
+    while (remaining) {
+        unsigned n = MIN(chunk, sectors);
+        if (lba > PICO_BLOCKDEV_SECTOR_MAX) {
+            r = -EFBIG;
+            break;
+        }
+        r = pico_blockdev_read_sector(dev, buf, (pico_blockdev_sector_t)lba, n);
+        if (r != (int)n) {
+            r = r < 0 ? r : -EIO;
+            break;
+        }
+        r = 0;
+
+        uint32_t len = MIN(remaining, n * sector_size);
+        crc = pico_blockdev_crc32(crc, buf, len);
+
+        for (uint32_t off = 0; off < len; off += info->entry_size) {
+            const struct gpt_entry *e = (const struct gpt_entry*)&buf[off];
+            static const uint8_t unused[sizeof(e->type_guid)] = { 0 };
+
+            if (memcmp(e->type_guid, unused, sizeof(unused)) == 0)
+                continue;
+
+            uint64_t first = pico_blockdev_extractle64(e->first_lba);
+            uint64_t last = pico_blockdev_extractle64(e->last_lba);
+
+            if (first > last || first < info->first_usable || last > info->last_usable || last >= total_sectors) {
+                BLKDEV_WARN(dev, "Skipping GPT entry outside the usable area\n");
+                continue;
+            }
+            if (*nfound == PICO_BLOCKDEV_GPT_MAX_PARTITIONS) {
+                BLKDEV_WARN(dev, "Too many GPT partitions, ignoring the rest\n");
+                continue;
+            }
+            found[*nfound].start = (pico_blockdev_sector_t)first;
+            found[*nfound].size = (pico_blockdev_sector_t)(last - first + 1);
+            (*nfound)++;
         }
+
+        remaining -= len;
+        sectors -= n;
+        lba += n;
     }
+
+    if (buf != sect)
+        free(buf);
+
+    if (r == 0 && crc != info->entries_crc)
+        r = -EBADMSG;
+    return r;
+}
+
+/*
+ Partitions are only created once the entry array has been verified. A
+ primary header or entry array that fails its checks falls back to the
+ backup header in the last sector and the entry array it points to.
+ */
+static int pico_blockdev_scan_gpt(pico_blockdev_t *dev, uint8_t *sect)
+{
+    uint32_t sector_size = pico_blockdev_get_sector_size(dev);
+    gpt_info_t info;
+    pico_blockdev_sector_t total_sectors = 0;
+    gpt_found_t found[PICO_BLOCKDEV_GPT_MAX_PARTITIONS];
+    unsigned nfound = 0;
+
+    if (pico_blockdev_get_sectors(dev, &total_sectors) < 0 || total_sectors < 2)
+        return -EINVAL;
+
+    int r = pico_blockdev_read_sector(dev, sect, 1, 1);
+    if (r == 1 && pico_blockdev_parse_gpt_header(sect, sector_size, 1, &info)) {
+        r = pico_blockdev_read_gpt_entries(dev, sect, &info, total_sectors, found, &nfound);
+        if (r == -EBADMSG) {
+            BLKDEV_WARN(dev, "Primary GPT partition entries CRC mismatch, trying backup\n");
+        }
+    } else {
+        BLKDEV_WARN(dev, "Primary GPT header invalid, trying backup\n");
+        r = -EINVAL;
+    }
+
+    if (r < 0) {
+        int b = pico_blockdev_read_sector(dev, sect, total_sectors - 1, 1);
+        if (b == 1 && pico_blockdev_parse_gpt_header(sect, sector_size, total_sectors - 1, &info))
+            r = pico_blockdev_read_gpt_entries(dev, sect, &info, total_sectors, found, &nfound);
+        if (r == -EBADMSG) {
+            BLKDEV_ERROR(dev, "GPT partition entries CRC mismatch\n");
+        }
+        if (r < 0)
+            return r;
+    }
+
+    for (unsigned i = 0; i < nfound; i++) {
+        pico_blockdev_add_partition(dev, found[i].start, found[i].size);
+    }
+    return 0;
 }
 
 void pico_blockdev_scan_partitions(pico_blockdev_t *dev)
 {
-    uint8_t sect[512];
+    uint32_t sector_size = pico_blockdev_get_sector_size(dev);
+    uint8_t *sect;
+
+    if (dev->ops == &part_ops) {
+        // No nested partition tables
+        return;
+    }
+
+    // The MBR signature sits at byte 510 of LBA 0 whatever the sector size
+    if (sector_size < 512) {
+        BLKDEV_WARN(dev, "Sector size %lu too small for a partition table\n", (unsigned long)sector_size);
+        return;
+    }
+
+    sect = pico_blockdev_buffer_get(dev);
+    if (NULL == sect) {
+        BLKDEV_ERROR(dev, "Cannot scan partitions, out of memory\n");
+        return;
+    }
+
     int r = pico_blockdev_read_sector(dev, sect, 0, 1);
     if (r==1) {
         if (sect[510]==0x55 && sect[511]==0xAA)
         {
-            BLKDEV_DEBUG(dev, "Found MSDOS partition table, scanning partitions\n");
+            if (pico_blockdev_is_protective_mbr(&sect[0x1be])) {
+                BLKDEV_DEBUG(dev, "Found GPT partition table, scanning partitions\n");
+                r = pico_blockdev_scan_gpt(dev, sect);
+                if (r < 0) {
+                    BLKDEV_ERROR(dev, "Cannot read GPT partition table, error %d\n", r);
+                }
+            } else {
+                BLKDEV_DEBUG(dev, "Found MSDOS partition table, scanning partitions\n");
 
-            for (int i=0; i<4; i++) {
-                pico_blockdev_check_msdos_partition(dev, &sect[0x1be], i);
+                for (int i=0; i<4; i++) {
+                    pico_blockdev_check_msdos_partition(dev, &sect[0x1be], i);
+                }
             }
         }
     } else {
         BLKDEV_ERROR(dev, "Cannot read first sector to read partition"
                      "table, error %d", r);
     }
+    pico_blockdev_buffer_put(sect);
 }
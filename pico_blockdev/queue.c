@@ -0,0 +1,581 @@
+#include "pico/blockdev.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/errno.h>
+#include <pico/sync.h>
+#include <pico/time.h>
+
+typedef struct pico_blockdev_merge__
+{
+    pico_blockdev_request_t req;     // Request handed to the driver
+    pico_blockdev_request_t *members; // Sorted by start sector
+    uint32_t sector_size;
+    uint8_t data[];                  // Bounce buffer
+} pico_blockdev_merge_t;
+
+extern void pico_blockdev_readahead_invalidate_locked(pico_blockdev_t *dev, pico_blockdev_sector_t start_sector, unsigned count);
+
+/*
+ Walk down remapping layers until the device that executes the I/O.
+ Layers with larger sectors than their parent scale the range first.
+ Returns the total shift applied, or a negative error.
+ */
+int pico_blockdev_map(pico_blockdev_t **dev, pico_blockdev_sector_t *sector, unsigned *count)
+{
+    const pico_blockdev_linear_t *l = &(*dev)->linear;
+    int shift = 0;
+
+    // Flattened stack: one bounds check and one offset
+    if (l->target) {
+        uint8_t s = l->shift;
+        if (*sector > (PICO_BLOCKDEV_SECTOR_MAX >> s) || *count > (UINT_MAX >> s))
+            return -EINVAL;
+        *sector <<= s;
+        *count <<= s;
+        if (*sector >= l->count || *count > l->count - *sector)
+            return -EINVAL;
+        *sector += l->offset;
+        *dev = l->target;
+        return s;
+    }
+
+    while ((*dev)->ops->map) {
+        uint8_t s = (*dev)->sector_shift;
+        if (s) {
+            if (*sector > (PICO_BLOCKDEV_SECTOR_MAX >> s) || *count > (UINT_MAX >> s))
+                return -EINVAL;
+            *sector <<= s;
+            *count <<= s;
+            shift += s;
+        }
+        int r = (*dev)->ops->map(*dev, sector, *count);
+        if (r < 0)
+            return r;
+        *dev = (*dev)->parent;
+    }
+    return shift;
+}
+
+/*
+ Compose the windows of a linear remapping layer and of the linear layers
+ below it into dev->linear. The parent must be flattened already. Layers
+ are walked one by one when this is not possible.
+ */
+void pico_blockdev_map_flatten(pico_blockdev_t *dev)
+{
+    pico_blockdev_t *parent = dev->parent;
+    pico_blockdev_linear_t l;
+    pico_blockdev_sector_t offset, count;
+
+    dev->linear.target = NULL;
+    if (!dev->ops->map || !dev->ops->linear || NULL == parent || dev->ops->linear(dev, &offset, &count) < 0)
+        return;
+
+    if (parent->ops->map) {
+        l = parent->linear;
+        if (NULL == l.target)
+            return;
+    } else {
+        l.target = parent;
+        l.offset = 0;
+        l.count = PICO_BLOCKDEV_SECTOR_MAX;
+        l.shift = 0;
+    }
+
+    // Into target sectors, clipped to the parent's window like map would
+    if (offset > (l.count >> l.shift) || count > (PICO_BLOCKDEV_SECTOR_MAX >> l.shift) ||
+        l.shift + dev->sector_shift > 16)
+        return;
+    offset <<= l.shift;
+    count <<= l.shift;
+    if (count > l.count - offset)
+        count = l.count - offset;
+
+    l.offset += offset;
+    l.count = count;
+    l.shift += dev->sector_shift;
+    dev->linear = l;
+}
+
+pico_blockdev_t *pico_blockdev_queue_owner(pico_blockdev_t *dev)
+{
+    if (dev->linear.target)
+        return dev->linear.target;
+    while (dev->ops->map)
+        dev = dev->parent;
+    return dev;
+}
+
+static inline pico_blockdev_sector_t pico_blockdev_req_end(const pico_blockdev_request_t *r)
+{
+    return r->start_sector + r->sector_count;
+}
+
+static inline bool pico_blockdev_req_conflict(const pico_blockdev_request_t *a, const pico_blockdev_request_t *b)
+{
+    return (a->is_write || b->is_write) &&
+        a->start_sector < pico_blockdev_req_end(b) &&
+        b->start_sector < pico_blockdev_req_end(a);
+}
+
+/* A request may not overtake an older one touching the same sectors */
+static bool pico_blockdev_req_eligible(const pico_blockdev_queue_t *q, const pico_blockdev_request_t *req)
+{
+    for (const pico_blockdev_request_t *r = q->head; r != req; r = r->next) {
+        if (pico_blockdev_req_conflict(r, req))
+            return false;
+    }
+    return true;
+}
+
+/* C-LOOK order: requests ahead of the head position first, in ascending LBA */
+static inline bool pico_blockdev_req_before(const pico_blockdev_queue_t *q, const pico_blockdev_request_t *a,
+                                            const pico_blockdev_request_t *b)
+{
+    bool a_ahead = a->start_sector >= q->position;
+    bool b_ahead = b->start_sector >= q->position;
+
+    if (a_ahead != b_ahead)
+        return a_ahead;
+    return a->start_sector < b->start_sector;
+}
+
+static pico_blockdev_request_t **pico_blockdev_queue_pick(pico_blockdev_queue_t *q)
+{
+    pico_blockdev_request_t **best = &q->head;
+
+    if ((int32_t)(time_us_32() - q->head->deadline) >= 0)
+        return best;
+
+    for (pico_blockdev_request_t **link = &q->head->next; *link; link = &(*link)->next) {
+        if (pico_blockdev_req_before(q, *link, *best) && pico_blockdev_req_eligible(q, *link))
+            best = link;
+    }
+    return best;
+}
+
+/* Submission time, recovered from the deadline */
+static inline uint32_t pico_blockdev_req_submitted(const pico_blockdev_request_t *r)
+{
+    return r->deadline - (r->is_write ? PICO_BLOCKDEV_WRITE_DEADLINE_US : PICO_BLOCKDEV_READ_DEADLINE_US);
+}
+
+#if PICO_BLOCKDEV_STATS
+/*
+ Statistics are updated with the executing device's lock held, which the
+ queue takes anyway, so they cost a few increments per request.
+ */
+static inline pico_blockdev_io_stats_t *pico_blockdev_stats_dir(pico_blockdev_t *dev, bool is_write)
+{
+    return is_write ? &dev->stats.write : &dev->stats.read;
+}
+
+static inline void pico_blockdev_stats_start(pico_blockdev_t *dev, uint32_t now)
+{
+    if (dev->stats.in_flight++ == 0)
+        dev->stats.busy_since = now;
+}
+
+/* sectors < 0 is an error */
+static void pico_blockdev_stats_done(pico_blockdev_t *dev, bool is_write, int sectors, uint32_t latency, uint32_t now)
+{
+    pico_blockdev_io_stats_t *io = pico_blockdev_stats_dir(dev, is_write);
+    unsigned bucket = latency ? 32 - __builtin_clz(latency) : 0;
+
+    io->ios++;
+    if (sectors < 0)
+        io->errors++;
+    else
+        io->sectors += sectors;
+    io->ticks_us += latency;
+    io->latency_hist[MIN(bucket, PICO_BLOCKDEV_STATS_HIST_BUCKETS - 1)]++;
+
+    if (--dev->stats.in_flight == 0)
+        dev->stats.busy_us += now - dev->stats.busy_since;
+}
+
+static void pico_blockdev_stats_complete(pico_blockdev_t *dev, pico_blockdev_request_t *r, int sectors, uint32_t now)
+{
+    uint32_t latency = now - pico_blockdev_req_submitted(r);
+
+    pico_blockdev_stats_done(dev, r->is_write, sectors, latency, now);
+    if (r->origin != dev)
+        pico_blockdev_stats_done(r->origin, r->is_write, sectors < 0 ? sectors : sectors >> r->shift, latency, now);
+}
+#endif
+
+static inline void pico_blockdev_req_finish(pico_blockdev_request_t *r, int status)
+{
+    r->status = status > 0 ? status >> r->shift : status;
+    if (r->completion)
+        r->completion(r->completion_user, r);
+}
+
+static pico_blockdev_request_t *pico_blockdev_queue_unlink(pico_blockdev_queue_t *q, pico_blockdev_request_t **link)
+{
+    pico_blockdev_request_t *req = *link;
+
+    *link = req->next;
+    if (q->tail == req) {
+        q->tail = q->head;
+        while (q->tail && q->tail->next)
+            q->tail = q->tail->next;
+    }
+    if (req->flags & PICO_BLOCKDEV_REQ_SYNC)
+        q->sync_pending--;
+    req->next = NULL;
+    return req;
+}
+
+/*
+ Pull pending requests adjacent to "first" into a sorted member list.
+ Reads may also overlap. Returns the member list.
+ */
+static pico_blockdev_request_t *pico_blockdev_queue_collect(pico_blockdev_queue_t *q, pico_blockdev_request_t *first)
+{
+    pico_blockdev_request_t *members = first;
+    pico_blockdev_sector_t start = first->start_sector;
+    pico_blockdev_sector_t end = pico_blockdev_req_end(first);
+    bool found;
+
+    do {
+        found = false;
+        for (pico_blockdev_request_t **link = &q->head; *link; link = &(*link)->next) {
+            pico_blockdev_request_t *r = *link;
+            pico_blockdev_sector_t r_end = pico_blockdev_req_end(r);
+
+            if (r->is_write != first->is_write || (r->flags & PICO_BLOCKDEV_REQ_VECTORED))
+                continue;
+            if (first->is_write ? (r->start_sector != end && r_end != start)
+                                : (r->start_sector > end || r_end < start))
+                continue;
+
+            pico_blockdev_sector_t new_start = MIN(start, r->start_sector);
+            pico_blockdev_sector_t new_end = MAX(end, r_end);
+            if (new_end - new_start > PICO_BLOCKDEV_MERGE_MAX_SECTORS)
+                continue;
+            if (!pico_blockdev_req_eligible(q, r))
+                continue;
+
+            pico_blockdev_queue_unlink(q, link);
+
+            pico_blockdev_request_t **pos = &members;
+            while (*pos && (*pos)->start_sector <= r->start_sector)
+                pos = &(*pos)->next;
+            r->next = *pos;
+            *pos = r;
+
+            start = new_start;
+            end = new_end;
+            found = true;
+            break;
+        }
+    } while (found);
+
+    return members;
+}
+
+/*
+ Build the driver request for a member list, using the callers' buffer
+ directly when all members are back to back in memory.
+ */
+static pico_blockdev_request_t *pico_blockdev_queue_prepare_merge(pico_blockdev_merge_t *m, pico_blockdev_request_t *members)
+{
+    pico_blockdev_request_t *req = &m->req;
+    pico_blockdev_request_t *r;
+    bool contiguous = true;
+    pico_blockdev_sector_t end = 0;
+
+    for (r = members; r; r = r->next) {
+        if (r->next) {
+            contiguous = contiguous &&
+                pico_blockdev_req_end(r) == r->next->start_sector &&
+                r->read_data + r->sector_count * m->sector_size == r->next->read_data;
+        }
+        end = MAX(end, pico_blockdev_req_end(r));
+    }
+
+    req->is_write = members->is_write;
+    req->start_sector = members->start_sector;
+    req->sector_count = end - members->start_sector;
+    req->completion = NULL;
+    req->flags = 0;
+    req->shift = 0;
+    req->next = NULL;
+
+    if (contiguous) {
+        req->read_data = members->read_data;
+    } else {
+        req->read_data = m->data;
+        if (req->is_write) {
+            for (r = members; r; r = r->next) {
+                memcpy(&m->data[(r->start_sector - req->start_sector) * m->sector_size],
+                       r->write_data, r->sector_count * m->sector_size);
+            }
+        }
+    }
+    m->members = members;
+    return req;
+}
+
+static void pico_blockdev_queue_run(pico_blockdev_t *dev)
+{
+    pico_blockdev_queue_t *q = &dev->queue;
+    pico_blockdev_request_t *req;
+
+    pico_object_lock(&dev->obj);
+
+    if (q->dispatching) {
+        pico_object_unlock(&dev->obj);
+        return;
+    }
+    q->dispatching = true;
+
+    // Synchronous drivers complete inside the loop, asynchronous ones leave
+    // the request active and we stop until pico_blockdev_request_complete().
+    while (!q->active && q->head && (!q->plugged || q->sync_pending)) {
+        req = pico_blockdev_queue_unlink(q, pico_blockdev_queue_pick(q));
+
+        if (q->merge && q->head && !(req->flags & PICO_BLOCKDEV_REQ_VECTORED)) {
+            pico_blockdev_request_t *members = pico_blockdev_queue_collect(q, req);
+            if (members->next) {
+#if PICO_BLOCKDEV_STATS
+                for (pico_blockdev_request_t *r = members; r; r = r->next) {
+                    if (r == req)
+                        continue;
+                    pico_blockdev_stats_dir(dev, r->is_write)->merges++;
+                    if (r->origin != dev)
+                        pico_blockdev_stats_dir(r->origin, r->is_write)->merges++;
+                }
+#endif
+                req = pico_blockdev_queue_prepare_merge(q->merge, members);
+            }
+        }
+        q->active = req;
+        q->position = pico_blockdev_req_end(req);
+
+        pico_object_unlock(&dev->obj);
+
+        int r;
+        if (dev->ops->request) {
+            r = (*dev->ops->request)(dev, req);
+            if (r < 0)
+                pico_blockdev_request_complete(dev, req, r);
+        } else if (req->flags & PICO_BLOCKDEV_REQ_VECTORED) {
+            if (req->is_write)
+                r = (*dev->ops->writev_sector)(dev, req->iov, req->iovcnt, req->start_sector, req->sector_count);
+            else
+                r = (*dev->ops->readv_sector)(dev, req->iov, req->iovcnt, req->start_sector, req->sector_count);
+            pico_blockdev_request_complete(dev, req, r);
+        } else {
+            if (req->is_write)
+                r = (*dev->ops->write_sector)(dev, req->write_data, req->start_sector, req->sector_count);
+            else
+                r = (*dev->ops->read_sector)(dev, req->read_data, req->start_sector, req->sector_count);
+            pico_blockdev_request_complete(dev, req, r);
+        }
+
+        pico_object_lock(&dev->obj);
+    }
+
+    q->dispatching = false;
+    pico_object_unlock(&dev->obj);
+}
+
+void pico_blockdev_request_complete(pico_blockdev_t *dev, pico_blockdev_request_t *req, int status)
+{
+    pico_blockdev_queue_t *q = &dev->queue;
+    pico_blockdev_merge_t *m = q->merge;
+    pico_blockdev_request_t *members = NULL;
+    bool run;
+
+    // Copy out of the bounce buffer before it can be reused
+    if (m && req == &m->req) {
+        members = m->members;
+        if (!req->is_write && status == (int)req->sector_count && req->read_data == m->data) {
+            for (pico_blockdev_request_t *r = members; r; r = r->next) {
+                memcpy(r->read_data, &m->data[(r->start_sector - req->start_sector) * m->sector_size],
+                       r->sector_count * m->sector_size);
+            }
+        }
+    }
+
+    pico_object_lock(&dev->obj);
+#if PICO_BLOCKDEV_STATS
+    uint32_t now = time_us_32();
+    if (members) {
+        for (pico_blockdev_request_t *r = members; r; r = r->next)
+            pico_blockdev_stats_complete(dev, r, status == (int)req->sector_count ? (int)r->sector_count : -EIO, now);
+    } else {
+        pico_blockdev_stats_complete(dev, req, status, now);
+    }
+#endif
+    q->active = NULL;
+    run = !q->dispatching;
+    pico_object_unlock(&dev->obj);
+
+    if (members) {
+        while (members) {
+            pico_blockdev_request_t *r = members;
+            members = r->next;
+            if (status == (int)req->sector_count)
+                pico_blockdev_req_finish(r, r->sector_count);
+            else
+                pico_blockdev_req_finish(r, status < 0 ? status : -EIO);
+        }
+    } else {
+        pico_blockdev_req_finish(req, status);
+    }
+
+    if (run)
+        pico_blockdev_queue_run(dev);
+}
+
+int pico_blockdev_queue_submit(pico_blockdev_t *dev, pico_blockdev_request_t *req, uint8_t flags)
+{
+    req->origin = dev;
+
+    int shift = pico_blockdev_map(&dev, &req->start_sector, &req->sector_count);
+    if (shift < 0)
+        return shift;
+
+    if (flags & PICO_BLOCKDEV_REQ_VECTORED) {
+        if (dev->ops->request ? !dev->ops->request_vectored
+                              : req->is_write ? !dev->ops->writev_sector : !dev->ops->readv_sector)
+            return -ENOSYS;
+    } else if (!dev->ops->request) {
+        if (req->is_write ? !dev->ops->write_sector : !dev->ops->read_sector)
+            return -ENOSYS;
+    }
+
+    req->status = 0;
+    req->flags = flags;
+    req->shift = shift;
+    req->next = NULL;
+    uint32_t now = time_us_32();
+    req->deadline = now +
+        (req->is_write ? PICO_BLOCKDEV_WRITE_DEADLINE_US : PICO_BLOCKDEV_READ_DEADLINE_US);
+
+    pico_object_lock(&dev->obj);
+#if PICO_BLOCKDEV_STATS
+    pico_blockdev_stats_start(dev, now);
+    if (req->origin != dev)
+        pico_blockdev_stats_start(req->origin, now);
+#endif
+    if (req->is_write && dev->readahead)
+        pico_blockdev_readahead_invalidate_locked(dev, req->start_sector, req->sector_count);
+    if (dev->queue.tail)
+        dev->queue.tail->next = req;
+    else
+        dev->queue.head = req;
+    dev->queue.tail = req;
+    if (flags & PICO_BLOCKDEV_REQ_SYNC)
+        dev->queue.sync_pending++;
+    pico_object_unlock(&dev->obj);
+
+    pico_blockdev_queue_run(dev);
+
+    return 0;
+}
+
+int pico_blockdev_submit(pico_blockdev_t *dev, pico_blockdev_request_t *req)
+{
+    return pico_blockdev_queue_submit(dev, req, 0);
+}
+
+void pico_blockdev_plug(pico_blockdev_t *dev)
+{
+    dev = pico_blockdev_queue_owner(dev);
+
+    pico_object_lock(&dev->obj);
+    dev->queue.plugged++;
+    pico_object_unlock(&dev->obj);
+}
+
+void pico_blockdev_unplug(pico_blockdev_t *dev)
+{
+    dev = pico_blockdev_queue_owner(dev);
+
+    pico_object_lock(&dev->obj);
+    assert(dev->queue.plugged != 0);
+    dev->queue.plugged--;
+    pico_object_unlock(&dev->obj);
+
+    pico_blockdev_queue_run(dev);
+}
+
+/*
+ Called on registration. The merge buffer is allocated here rather than on
+ first use since dispatch may run in IRQ context.
+ */
+void pico_blockdev_queue_setup(pico_blockdev_t *dev)
+{
+    if (PICO_BLOCKDEV_MERGE_MAX_SECTORS == 0 || dev->ops->map || dev->queue.merge)
+        return;
+
+    uint32_t sector_size = pico_blockdev_get_sector_size(dev);
+
+    pico_blockdev_merge_t *m = malloc(sizeof(pico_blockdev_merge_t) + PICO_BLOCKDEV_MERGE_MAX_SECTORS * sector_size);
+    if (NULL == m) {
+        BLKDEV_WARN(dev, "No memory for request merging\n");
+        return;
+    }
+    m->members = NULL;
+    m->sector_size = sector_size;
+
+    pico_object_lock(&dev->obj);
+    dev->queue.merge = m;
+    pico_object_unlock(&dev->obj);
+}
+
+int pico_blockdev_stats_get(pico_blockdev_t *dev, pico_blockdev_stats_t *stats)
+{
+#if PICO_BLOCKDEV_STATS
+    pico_blockdev_t *owner = pico_blockdev_queue_owner(dev);
+
+    pico_object_lock(&owner->obj);
+    *stats = dev->stats;
+    if (stats->in_flight)
+        stats->busy_us += time_us_32() - stats->busy_since;
+    pico_object_unlock(&owner->obj);
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+/* A request of origin that dev, its queue owner, served without queueing it */
+void pico_blockdev_stats_account(pico_blockdev_t *dev, pico_blockdev_t *origin, bool is_write, int sectors, uint32_t submitted)
+{
+#if PICO_BLOCKDEV_STATS
+    uint32_t now = time_us_32();
+
+    pico_object_lock(&dev->obj);
+    pico_blockdev_stats_start(origin, submitted);
+    pico_blockdev_stats_done(origin, is_write, sectors, now - submitted, now);
+    pico_object_unlock(&dev->obj);
+#endif
+}
+
+void pico_blockdev_stats_flush(pico_blockdev_t *dev, uint32_t ticks_us)
+{
+#if PICO_BLOCKDEV_STATS
+    pico_blockdev_t *owner = pico_blockdev_queue_owner(dev);
+
+    pico_object_lock(&owner->obj);
+    owner->stats.flushes++;
+    owner->stats.flush_ticks_us += ticks_us;
+    if (dev != owner) {
+        dev->stats.flushes++;
+        dev->stats.flush_ticks_us += ticks_us;
+    }
+    pico_object_unlock(&owner->obj);
+#endif
+}
+
+void pico_blockdev_queue_release(pico_blockdev_t *dev)
+{
+    free(dev->queue.merge);
+    dev->queue.merge = NULL;
+}
@@ -0,0 +1,177 @@
+#include "pico/blockdev_ramdisk.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+typedef struct
+{
+    struct pico_blockdev__ dev;
+    uint8_t *mem;
+    pico_blockdev_sector_t num_sectors;
+    uint32_t sector_size;
+    bool readonly;
+    bool owned;           // mem allocated by us
+} pico_blockdev_ramdisk_t;
+
+static int pico_blockdev_ramdisk_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_ramdisk_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_ramdisk_readv_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                              pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_ramdisk_writev_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                               pico_blockdev_sector_t start_sector, unsigned count);
+static int pico_blockdev_ramdisk_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data);
+static void pico_blockdev_ramdisk_destroy(pico_blockdev_t *dev);
+
+static const pico_blockdev_ops_t ramdisk_ops =
+{
+    .read_sector = pico_blockdev_ramdisk_read_sector,
+    .write_sector = pico_blockdev_ramdisk_write_sector,
+    .readv_sector = pico_blockdev_ramdisk_readv_sector,
+    .writev_sector = pico_blockdev_ramdisk_writev_sector,
+    .ioctl = pico_blockdev_ramdisk_ioctl,
+    .destroy = pico_blockdev_ramdisk_destroy
+};
+
+static inline bool pico_blockdev_ramdisk_in_range(pico_blockdev_ramdisk_t *d, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    return start_sector < d->num_sectors && count <= d->num_sectors - start_sector;
+}
+
+static int pico_blockdev_ramdisk_read_sector(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_ramdisk_t *d = (pico_blockdev_ramdisk_t*)dev;
+
+    if (!pico_blockdev_ramdisk_in_range(d, start_sector, count))
+        return -EINVAL;
+
+    memcpy(data, &d->mem[(size_t)start_sector * d->sector_size], (size_t)count * d->sector_size);
+    return count;
+}
+
+static int pico_blockdev_ramdisk_write_sector(pico_blockdev_t *dev, const unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_ramdisk_t *d = (pico_blockdev_ramdisk_t*)dev;
+
+    if (d->readonly)
+        return -EROFS;
+    if (!pico_blockdev_ramdisk_in_range(d, start_sector, count))
+        return -EINVAL;
+
+    memcpy(&d->mem[(size_t)start_sector * d->sector_size], data, (size_t)count * d->sector_size);
+    return count;
+}
+
+static int pico_blockdev_ramdisk_readv_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                              pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_ramdisk_t *d = (pico_blockdev_ramdisk_t*)dev;
+
+    if (!pico_blockdev_ramdisk_in_range(d, start_sector, count))
+        return -EINVAL;
+
+    const uint8_t *src = &d->mem[(size_t)start_sector * d->sector_size];
+    for (unsigned i = 0; i < iovcnt; i++) {
+        size_t len = (size_t)iov[i].count * d->sector_size;
+        memcpy(iov[i].data, src, len);
+        src += len;
+    }
+    return count;
+}
+
+static int pico_blockdev_ramdisk_writev_sector(pico_blockdev_t *dev, const pico_blockdev_iovec_t *iov, unsigned iovcnt,
+                                               pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_ramdisk_t *d = (pico_blockdev_ramdisk_t*)dev;
+
+    if (d->readonly)
+        return -EROFS;
+    if (!pico_blockdev_ramdisk_in_range(d, start_sector, count))
+        return -EINVAL;
+
+    uint8_t *dst = &d->mem[(size_t)start_sector * d->sector_size];
+    for (unsigned i = 0; i < iovcnt; i++) {
+        size_t len = (size_t)iov[i].count * d->sector_size;
+        memcpy(dst, iov[i].data, len);
+        dst += len;
+    }
+    return count;
+}
+
+static int pico_blockdev_ramdisk_ioctl(pico_blockdev_t *dev, unsigned char cmd, void* data)
+{
+    pico_blockdev_ramdisk_t *d = (pico_blockdev_ramdisk_t*)dev;
+
+    switch (cmd)
+    {
+    case PICO_IOCTL_BLKGETSIZE:
+        if (d->num_sectors > UINT32_MAX)
+            return -EFBIG;
+        *(uint32_t*)data = d->num_sectors;
+        return 0;
+    case PICO_IOCTL_BLKGETSIZE64:
+        *(uint64_t*)data = (uint64_t)d->num_sectors * d->sector_size;
+        return 0;
+    case PICO_IOCTL_BLKROGET:
+        *(int*)data = d->readonly;
+        return 0;
+    case PICO_IOCTL_BLKFLSBUF:
+        return 0;
+    case PICO_IOCTL_BLKDIRECT: {
+        pico_blockdev_direct_t *direct = (pico_blockdev_direct_t*)data;
+        if (!pico_blockdev_ramdisk_in_range(d, direct->sector, direct->count))
+            return -EINVAL;
+        direct->addr = &d->mem[(size_t)direct->sector * d->sector_size];
+        return 0;
+    }
+    case PICO_IOCTL_BLKDISCARD: {
+        pico_blockdev_range_t *range = (pico_blockdev_range_t*)data;
+        if (d->readonly)
+            return -EROFS;
+        if (!pico_blockdev_ramdisk_in_range(d, range->sector, range->count))
+            return -EINVAL;
+        memset(&d->mem[(size_t)range->sector * d->sector_size], 0, (size_t)range->count * d->sector_size);
+        return 0;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+static void pico_blockdev_ramdisk_destroy(pico_blockdev_t *dev)
+{
+    pico_blockdev_ramdisk_t *d = (pico_blockdev_ramdisk_t*)dev;
+
+    if (d->owned)
+        free(d->mem);
+    free(d);
+}
+
+pico_blockdev_t *pico_blockdev_ramdisk_create(void *mem, size_t size, uint32_t sector_size, bool readonly)
+{
+    if (sector_size == 0 || size < sector_size)
+        return NULL;
+
+    pico_blockdev_ramdisk_t *d = calloc(1, sizeof(pico_blockdev_ramdisk_t));
+    if (NULL == d)
+        return NULL;
+
+    if (NULL == mem) {
+        mem = calloc(1, size);
+        if (NULL == mem) {
+            free(d);
+            return NULL;
+        }
+        d->owned = true;
+    }
+
+    d->mem = (uint8_t*)mem;
+    d->num_sectors = size / sector_size;
+    d->sector_size = sector_size;
+    d->readonly = readonly;
+
+    pico_blockdev_init(&d->dev, &ramdisk_ops);
+    pico_blockdev_set_name(&d->dev, "ram");
+    pico_blockdev_set_sector_size(&d->dev, sector_size);
+
+    return &d->dev;
+}
@@ -0,0 +1,252 @@
+#include "pico/blockdev.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <pico/sync.h>
+
+#define READAHEAD_MIN_WINDOW (2)
+
+typedef struct pico_blockdev_readahead__
+{
+    mutex_t lock;                       // Serialises readers
+    pico_blockdev_t *dev;
+    pico_blockdev_request_t req;        // Prefetch request
+    semaphore_t done;                   // Released once per prefetch, when it completes
+    pico_blockdev_readahead_stats_t stats;
+    uint32_t sector_size;
+    pico_blockdev_sector_t total_sectors;
+    pico_blockdev_sector_t next_sector; // Where a sequential reader continues
+    pico_blockdev_sector_t start;       // First sector in the buffer
+    uint16_t count;                     // Valid sectors in the buffer
+    uint16_t used;                      // Sectors consumed from the buffer
+    uint16_t pending;                   // Sectors being prefetched
+    uint8_t sequential;                 // Length of the current sequential run
+    volatile bool busy;                 // Prefetch in flight
+    bool issued;                        // Prefetch whose completion was not waited for yet
+    bool stale;                         // Written to while in flight
+    uint32_t generation;                // Bumped when a write invalidates the buffer
+    uint8_t data[];
+} pico_blockdev_readahead_t;
+
+extern pico_blockdev_t *pico_blockdev_queue_owner(pico_blockdev_t *dev);
+extern int pico_blockdev_read_sync(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count);
+
+static void pico_blockdev_readahead_completion(void *user, pico_blockdev_request_t *req)
+{
+    pico_blockdev_readahead_t *ra = (pico_blockdev_readahead_t*)user;
+
+    pico_object_lock(&ra->dev->obj);
+    ra->count = (req->status == (int)ra->pending && !ra->stale) ? ra->pending : 0;
+    ra->busy = false;
+    pico_object_unlock(&ra->dev->obj);
+
+    sem_release(&ra->done);
+}
+
+/* Wait for the last prefetch to complete. Called with the reader lock held */
+static void pico_blockdev_readahead_wait(pico_blockdev_readahead_t *ra)
+{
+    if (ra->issued) {
+        sem_acquire_blocking(&ra->done);
+        ra->issued = false;
+    }
+}
+
+/*
+ Start fetching the next window. The window doubles when the previous
+ buffer was consumed entirely and halves when most of it went unused,
+ but covers at least the reader's last request.
+ */
+static void pico_blockdev_readahead_issue(pico_blockdev_readahead_t *ra, unsigned min_window)
+{
+    pico_blockdev_readahead_stats_t *st = &ra->stats;
+
+    // Completed already, but its permit must not satisfy the wait for the next one
+    pico_blockdev_readahead_wait(ra);
+
+    if (ra->pending) {
+        st->wasted += ra->count - ra->used;
+        if (ra->count && ra->used == ra->count)
+            st->window = MIN(st->window * 2, st->max_window);
+        else if (ra->used < ra->count / 2)
+            st->window = MAX(st->window / 2, READAHEAD_MIN_WINDOW);
+    }
+    st->window = MAX(st->window, min_window);
+
+    if (ra->next_sector >= ra->total_sectors)
+        return;
+
+    unsigned n = MIN(st->window, ra->total_sectors - ra->next_sector);
+
+    pico_object_lock(&ra->dev->obj);
+    ra->start = ra->next_sector;
+    ra->count = 0;
+    ra->used = 0;
+    ra->pending = n;
+    ra->busy = true;
+    ra->stale = false;
+    pico_object_unlock(&ra->dev->obj);
+
+    int r = pico_blockdev_read_sector_async(ra->dev, &ra->req, ra->data, ra->start, n,
+                                            &pico_blockdev_readahead_completion, ra);
+    if (r < 0) {
+        ra->busy = false;
+        ra->pending = 0;
+        return;
+    }
+    ra->issued = true;
+    st->prefetches++;
+}
+
+int pico_blockdev_readahead_read(pico_blockdev_t *dev, unsigned char* data, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_readahead_t *ra = dev->readahead;
+    unsigned served = 0;
+    uint32_t generation;
+    bool valid;
+
+    mutex_enter_blocking(&ra->lock);
+
+    if (ra->busy && start_sector < ra->start + ra->pending && start_sector + count > ra->start) {
+        pico_blockdev_readahead_wait(ra);
+    }
+
+    pico_object_lock(&dev->obj);
+    valid = !ra->busy && start_sector >= ra->start && start_sector < ra->start + ra->count;
+    generation = ra->generation;
+    pico_object_unlock(&dev->obj);
+
+    if (valid) {
+        served = MIN(count, ra->start + ra->count - start_sector);
+        memcpy(data, &ra->data[(start_sector - ra->start) * ra->sector_size], served * ra->sector_size);
+
+        // A write submitted during the copy may have completed already; its data wins
+        pico_object_lock(&dev->obj);
+        if (ra->generation != generation)
+            served = 0;
+        pico_object_unlock(&dev->obj);
+
+        ra->used += served;
+        ra->stats.hits += served;
+    }
+
+    if (served < count) {
+        int r = pico_blockdev_read_sync(dev, &data[served * ra->sector_size], start_sector + served, count - served);
+        if (r != (int)(count - served)) {
+            mutex_exit(&ra->lock);
+            return r < 0 ? r : (int)served + r;
+        }
+        if (start_sector == ra->next_sector)
+            ra->stats.misses += count - served;
+    }
+
+    if (start_sector == ra->next_sector) {
+        if (ra->sequential < 255)
+            ra->sequential++;
+    } else {
+        ra->sequential = 0;
+    }
+    ra->next_sector = start_sector + count;
+
+    // Prefetch once a stream is established and the reader has left the buffer.
+    // Requests as large as the buffer would only be split between it and the device
+    if (ra->sequential && !ra->busy && count < ra->stats.max_window &&
+        (ra->next_sector < ra->start || ra->next_sector >= ra->start + ra->count)) {
+        pico_blockdev_readahead_issue(ra, count);
+    }
+
+    mutex_exit(&ra->lock);
+
+    return count;
+}
+
+/* Called with the device lock held for every write submitted to dev */
+void pico_blockdev_readahead_invalidate_locked(pico_blockdev_t *dev, pico_blockdev_sector_t start_sector, unsigned count)
+{
+    pico_blockdev_readahead_t *ra = dev->readahead;
+    unsigned extent = ra->busy ? ra->pending : ra->count;
+
+    if (start_sector < ra->start + extent && start_sector + count > ra->start) {
+        if (ra->busy)
+            ra->stale = true;
+        ra->count = 0;
+        ra->generation++;
+    }
+}
+
+int pico_blockdev_readahead_enable(pico_blockdev_t *dev, unsigned max_sectors)
+{
+    uint32_t sector_size;
+    pico_blockdev_sector_t total_sectors = 0;
+
+    dev = pico_blockdev_queue_owner(dev);
+
+    if (dev->readahead)
+        return -EALREADY;
+
+    if (pico_blockdev_get_sectors(dev, &total_sectors) < 0)
+        return -ENOTSUP;
+
+    sector_size = pico_blockdev_get_sector_size(dev);
+
+    if (max_sectors == 0) {
+        uint32_t opt = 0;
+        if (pico_blockdev_ioctl(dev, PICO_IOCTL_BLKIOOPT, &opt) == 0 && opt >= sector_size)
+            max_sectors = opt / sector_size;
+        else
+            max_sectors = PICO_BLOCKDEV_READAHEAD_MAX_SECTORS;
+    }
+    max_sectors = MIN(MAX(max_sectors, READAHEAD_MIN_WINDOW), 0xFFFF);
+
+    pico_blockdev_readahead_t *ra = calloc(1, sizeof(pico_blockdev_readahead_t) + max_sectors * sector_size);
+    if (NULL == ra)
+        return -ENOMEM;
+
+    mutex_init(&ra->lock);
+    sem_init(&ra->done, 0, 1);
+    ra->dev = dev;
+    ra->sector_size = sector_size;
+    ra->total_sectors = total_sectors;
+    ra->next_sector = PICO_BLOCKDEV_SECTOR_MAX;
+    ra->stats.max_window = max_sectors;
+    ra->stats.window = MIN(4, max_sectors);
+
+    pico_object_lock(&dev->obj);
+    dev->readahead = ra;
+    pico_object_unlock(&dev->obj);
+
+    return 0;
+}
+
+void pico_blockdev_readahead_disable(pico_blockdev_t *dev)
+{
+    dev = pico_blockdev_queue_owner(dev);
+
+    pico_blockdev_readahead_t *ra = dev->readahead;
+    if (NULL == ra)
+        return;
+
+    mutex_enter_blocking(&ra->lock);
+    pico_blockdev_readahead_wait(ra);
+
+    pico_object_lock(&dev->obj);
+    dev->readahead = NULL;
+    pico_object_unlock(&dev->obj);
+
+    mutex_exit(&ra->lock);
+    free(ra);
+}
+
+int pico_blockdev_readahead_stats(pico_blockdev_t *dev, pico_blockdev_readahead_stats_t *stats)
+{
+    dev = pico_blockdev_queue_owner(dev);
+
+    pico_blockdev_readahead_t *ra = dev->readahead;
+    if (NULL == ra)
+        return -ENOTSUP;
+
+    mutex_enter_blocking(&ra->lock);
+    *stats = ra->stats;
+    mutex_exit(&ra->lock);
+    return 0;
+}
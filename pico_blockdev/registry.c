@@ -0,0 +1,289 @@
+#include "pico/blockdev.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+#include <pico/sync.h>
+#include <pico/platform.h>
+
+extern void pico_blockdev_scan_partitions(pico_blockdev_t *dev);
+
+/* Room left after the base for the number and a partition suffix */
+#define REGISTRY_SUFFIX_MAX (8)
+
+/* Deferred partition scan states; a running scan records its owner */
+#define SCAN_DONE (0)
+#define SCAN_PENDING (1)
+#define SCAN_RUNNING (2)
+
+static pico_blockdev_t *registry_hash[PICO_BLOCKDEV_REGISTRY_BUCKETS];
+static pico_blockdev_t *registry_head;
+static pico_blockdev_t *registry_tail;
+static critical_section_t registry_lock;
+static pico_object_once_t registry_lock_once;
+
+static void pico_blockdev_registry_lock_setup(void)
+{
+    critical_section_init(&registry_lock);
+}
+
+static inline void pico_blockdev_registry_init(void)
+{
+    pico_object_once(&registry_lock_once, pico_blockdev_registry_lock_setup);
+}
+
+/* FNV-1a */
+static uint32_t pico_blockdev_name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline pico_blockdev_t **pico_blockdev_bucket(const char *name)
+{
+    return &registry_hash[pico_blockdev_name_hash(name) & (PICO_BLOCKDEV_REGISTRY_BUCKETS - 1)];
+}
+
+/* Called with the lock held */
+static pico_blockdev_t *pico_blockdev_registry_find(const char *name)
+{
+    for (pico_blockdev_t *d = *pico_blockdev_bucket(name); d; d = d->hash_next) {
+        if (strcmp(d->name, name) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+/* Called with the lock held */
+static void pico_blockdev_registry_name(pico_blockdev_t *dev)
+{
+    pico_blockdev_t *parent = dev->parent;
+    char base[PICO_BLOCKDEV_NAME_MAX - REGISTRY_SUFFIX_MAX];
+
+    if (dev->ops->map && parent && parent->registered) {
+        int n = snprintf(dev->name, sizeof(dev->name), "%sp%u", parent->name, ++parent->num_partitions);
+        if (n < (int)sizeof(dev->name) && NULL == pico_blockdev_registry_find(dev->name))
+            return;
+        strcpy(base, "part");
+    } else {
+        // Fits, pico_blockdev_set_name() checks the length
+        strcpy(base, dev->name[0] ? dev->name : "blk");
+    }
+
+    for (uint16_t n = 0; ; n++) {
+        snprintf(dev->name, sizeof(dev->name), "%s%u", base, (unsigned)n);
+        if (NULL == pico_blockdev_registry_find(dev->name))
+            break;
+    }
+}
+
+void pico_blockdev_registry_add(pico_blockdev_t *dev, bool scan_pending)
+{
+    pico_blockdev_registry_init();
+    pico_blockdev_ref(dev);
+
+    critical_section_enter_blocking(&registry_lock);
+    // Registered again: the successor pinned by the last removal is not needed
+    pico_blockdev_t *pinned = dev->registered ? NULL : dev->list_next;
+    pico_blockdev_registry_name(dev);
+
+    pico_blockdev_t **bucket = pico_blockdev_bucket(dev->name);
+    dev->hash_next = *bucket;
+    *bucket = dev;
+
+    dev->list_next = NULL;
+    if (registry_tail)
+        registry_tail->list_next = dev;
+    else
+        registry_head = dev;
+    registry_tail = dev;
+    dev->registered = true;
+    dev->scan_state = scan_pending ? SCAN_PENDING : SCAN_DONE;
+    critical_section_exit(&registry_lock);
+
+    if (pinned)
+        pico_blockdev_unref(pinned);
+}
+
+/* Returns whether dev was registered; the caller drops the registry's reference */
+bool pico_blockdev_registry_remove(pico_blockdev_t *dev)
+{
+    pico_blockdev_t *prev = NULL;
+    bool registered;
+
+    pico_blockdev_registry_init();
+
+    critical_section_enter_blocking(&registry_lock);
+    registered = dev->registered;
+    if (registered) {
+        pico_blockdev_t **link = pico_blockdev_bucket(dev->name);
+        while (*link != dev)
+            link = &(*link)->hash_next;
+        *link = dev->hash_next;
+
+        for (link = &registry_head; *link != dev; link = &(*link)->list_next)
+            prev = *link;
+        *link = dev->list_next;
+        if (registry_tail == dev)
+            registry_tail = prev;
+        dev->registered = false;
+        // Walks holding dev go on from its successor, which is kept until dev is freed
+        if (dev->list_next)
+            pico_blockdev_ref(dev->list_next);
+    }
+    critical_section_exit(&registry_lock);
+
+    return registered;
+}
+
+/* Called when dev is freed */
+void pico_blockdev_registry_release(pico_blockdev_t *dev)
+{
+    if (!dev->registered && dev->list_next)
+        pico_blockdev_unref(dev->list_next);
+}
+
+int pico_blockdev_set_name(pico_blockdev_t *dev, const char *base)
+{
+    if (dev->registered)
+        return -EBUSY;
+    if (strlen(base) > PICO_BLOCKDEV_NAME_MAX - 1 - REGISTRY_SUFFIX_MAX)
+        return -ENAMETOOLONG;
+    strcpy(dev->name, base);
+    // Drivers name their devices, so count them apart by it
+    pico_object_set_type(&dev->obj, base);
+    return 0;
+}
+
+const char *pico_blockdev_get_name(pico_blockdev_t *dev)
+{
+    return dev->name;
+}
+
+/* Device with a pending scan whose partitions would be called name. Called with the lock held */
+static pico_blockdev_t *pico_blockdev_registry_find_pending(const char *name)
+{
+    for (pico_blockdev_t *d = registry_head; d; d = d->list_next) {
+        size_t len = strlen(d->name);
+        if (d->scan_state == SCAN_PENDING && strncmp(d->name, name, len) == 0 && name[len] == 'p')
+            return d;
+    }
+    return NULL;
+}
+
+pico_blockdev_t *pico_blockdev_lookup(const char *name)
+{
+    pico_blockdev_t *pending = NULL;
+
+    pico_blockdev_registry_init();
+
+    critical_section_enter_blocking(&registry_lock);
+    pico_blockdev_t *dev = pico_blockdev_registry_find(name);
+    if (dev) {
+        pico_blockdev_ref(dev);
+    } else {
+        pending = pico_blockdev_registry_find_pending(name);
+        if (pending)
+            pico_blockdev_ref(pending);
+    }
+    critical_section_exit(&registry_lock);
+
+    // Not found yet, perhaps a partition that the scan will find
+    if (pending) {
+        pico_blockdev_scan(pending);
+        pico_blockdev_unref(pending);
+        critical_section_enter_blocking(&registry_lock);
+        dev = pico_blockdev_registry_find(name);
+        if (dev)
+            pico_blockdev_ref(dev);
+        critical_section_exit(&registry_lock);
+    }
+
+    return dev;
+}
+
+pico_blockdev_t *pico_blockdev_next(pico_blockdev_t *prev)
+{
+    pico_blockdev_t *dev;
+
+    pico_blockdev_registry_init();
+
+    critical_section_enter_blocking(&registry_lock);
+    if (NULL == prev) {
+        dev = registry_head;
+    } else {
+        // Unregistered devices are kept alive by their predecessor in the walk
+        dev = prev->list_next;
+        while (dev && !dev->registered)
+            dev = dev->list_next;
+    }
+    if (dev)
+        pico_blockdev_ref(dev);
+    critical_section_exit(&registry_lock);
+
+    if (prev)
+        pico_blockdev_unref(prev);
+    return dev;
+}
+
+void pico_blockdev_scan(pico_blockdev_t *dev)
+{
+    lock_owner_id_t self = lock_get_caller_owner_id();
+    lock_owner_id_t owner;
+    uint8_t state;
+
+    pico_blockdev_registry_init();
+
+    critical_section_enter_blocking(&registry_lock);
+    state = dev->scan_state;
+    owner = dev->scan_owner;
+    bool claimed = state == SCAN_PENDING && dev->registered;
+    if (claimed) {
+        dev->scan_state = SCAN_RUNNING;
+        dev->scan_owner = self;
+    }
+    critical_section_exit(&registry_lock);
+
+    if (claimed) {
+        pico_blockdev_scan_partitions(dev);
+        critical_section_enter_blocking(&registry_lock);
+        dev->scan_state = SCAN_DONE;
+        critical_section_exit(&registry_lock);
+        return;
+    }
+
+    // Run by ourselves means we are called back from the scan itself,
+    // e.g. by the register event of a partition: waiting would never end
+    while (state == SCAN_RUNNING && owner != self) {
+        tight_loop_contents();
+        critical_section_enter_blocking(&registry_lock);
+        state = dev->scan_state;
+        critical_section_exit(&registry_lock);
+    }
+}
+
+bool pico_blockdev_scan_pending(void)
+{
+    pico_blockdev_t *dev;
+
+    pico_blockdev_registry_init();
+
+    critical_section_enter_blocking(&registry_lock);
+    for (dev = registry_head; dev; dev = dev->list_next) {
+        if (dev->scan_state == SCAN_PENDING)
+            break;
+    }
+    if (dev)
+        pico_blockdev_ref(dev);
+    critical_section_exit(&registry_lock);
+
+    if (NULL == dev)
+        return false;
+    pico_blockdev_scan(dev);
+    pico_blockdev_unref(dev);
+    return true;
+}
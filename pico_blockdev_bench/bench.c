@@ -0,0 +1,348 @@
+#include "pico/blockdev_bench.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pico/sync.h>
+#include <pico/time.h>
+
+/*
+ Log-linear latency histogram: values below 2^HIST_SUB_BITS get a bucket
+ each, above that every power of two is split into 2^HIST_SUB_BITS buckets.
+ */
+#define HIST_SUB_BITS (3)
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_MAX_BITS (40)   // ~18 minutes in ns
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Largest queue depth, bounds the completion scan */
+#define BENCH_MAX_QUEUE_DEPTH (32)
+
+typedef struct pico_blockdev_bench_state__ pico_blockdev_bench_state_t;
+
+typedef struct
+{
+    pico_blockdev_request_t req;
+    pico_blockdev_bench_state_t *state;
+    uint8_t *buf;
+    uint64_t start;
+    uint64_t latency;
+    bool is_write;
+    volatile bool done;
+} pico_blockdev_bench_slot_t;
+
+struct pico_blockdev_bench_state__
+{
+    const pico_blockdev_bench_config_t *config;
+    pico_blockdev_bench_result_t *result;
+    pico_blockdev_t *dev;
+    uint32_t sector_size;
+    pico_blockdev_sector_t start;
+    pico_blockdev_sector_t blocks;   // Region size in requests
+    pico_blockdev_sector_t next;     // Sequential position, in blocks
+    uint32_t rng;
+    uint32_t issued;
+    uint64_t lat_sum;
+    uint64_t deadline;
+    semaphore_t done;
+    uint32_t hist[HIST_BUCKETS];
+};
+
+uint64_t __attribute__((weak)) pico_blockdev_bench_now_ns(void)
+{
+    return time_us_64() * 1000;
+}
+
+static inline unsigned pico_blockdev_bench_bucket(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+
+    unsigned e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Middle of the range covered by a bucket */
+static inline uint64_t pico_blockdev_bench_bucket_value(unsigned b)
+{
+    if (b < HIST_SUB)
+        return b;
+
+    unsigned e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t lower = (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+    return lower + ((1ull << (e - HIST_SUB_BITS)) >> 1);
+}
+
+static uint64_t pico_blockdev_bench_percentile(const pico_blockdev_bench_state_t *b, uint32_t total, unsigned per_mille)
+{
+    uint64_t target = ((uint64_t)total * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += b->hist[i];
+        if (seen >= target && seen)
+            return pico_blockdev_bench_bucket_value(i);
+    }
+    return 0;
+}
+
+static inline uint32_t pico_blockdev_bench_rand(pico_blockdev_bench_state_t *b)
+{
+    // xorshift32
+    uint32_t x = b->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    b->rng = x;
+    return x;
+}
+
+static bool pico_blockdev_bench_more(pico_blockdev_bench_state_t *b)
+{
+    if (b->config->total_ios && b->issued >= b->config->total_ios)
+        return false;
+    if (b->deadline && pico_blockdev_bench_now_ns() >= b->deadline)
+        return false;
+    return true;
+}
+
+/* Picks the next request: returns its first sector and whether it writes */
+static pico_blockdev_sector_t pico_blockdev_bench_next(pico_blockdev_bench_state_t *b, bool *is_write)
+{
+    const pico_blockdev_bench_config_t *cfg = b->config;
+    pico_blockdev_sector_t block;
+
+    if (cfg->random) {
+        uint64_t r = pico_blockdev_bench_rand(b);
+        if (b->blocks > UINT32_MAX)
+            r = (r << 32) | pico_blockdev_bench_rand(b);
+        block = r % b->blocks;
+    } else {
+        block = b->next;
+        if (++b->next == b->blocks)
+            b->next = 0;
+    }
+
+    *is_write = cfg->read_percent < 100 && pico_blockdev_bench_rand(b) % 100 >= cfg->read_percent;
+    b->issued++;
+    return b->start + block * cfg->block_sectors;
+}
+
+static void pico_blockdev_bench_account(pico_blockdev_bench_state_t *b, bool is_write, int status, uint64_t latency)
+{
+    pico_blockdev_bench_result_t *res = b->result;
+    unsigned count = b->config->block_sectors;
+
+    res->ios++;
+    if (status != (int)count) {
+        res->errors++;
+        return;
+    }
+    if (is_write)
+        res->writes++;
+    else
+        res->reads++;
+    res->bytes += (uint64_t)count * b->sector_size;
+
+    b->hist[pico_blockdev_bench_bucket(latency)]++;
+    b->lat_sum += latency;
+    res->lat_min = MIN(res->lat_min, latency);
+    res->lat_max = MAX(res->lat_max, latency);
+}
+
+static void pico_blockdev_bench_run_sync(pico_blockdev_bench_state_t *b, uint8_t *buf)
+{
+    while (pico_blockdev_bench_more(b)) {
+        bool is_write;
+        pico_blockdev_sector_t sector = pico_blockdev_bench_next(b, &is_write);
+        unsigned count = b->config->block_sectors;
+        int r;
+
+        uint64_t t0 = pico_blockdev_bench_now_ns();
+        if (is_write)
+            r = pico_blockdev_write_sector(b->dev, buf, sector, count);
+        else
+            r = pico_blockdev_read_sector(b->dev, buf, sector, count);
+        pico_blockdev_bench_account(b, is_write, r, pico_blockdev_bench_now_ns() - t0);
+    }
+}
+
+static void pico_blockdev_bench_completion(void *user, pico_blockdev_request_t *req)
+{
+    pico_blockdev_bench_slot_t *slot = (pico_blockdev_bench_slot_t*)user;
+
+    slot->latency = pico_blockdev_bench_now_ns() - slot->start;
+    slot->done = true;
+    sem_release(&slot->state->done);
+}
+
+static bool pico_blockdev_bench_issue(pico_blockdev_bench_state_t *b, pico_blockdev_bench_slot_t *slot)
+{
+    pico_blockdev_sector_t sector = pico_blockdev_bench_next(b, &slot->is_write);
+    unsigned count = b->config->block_sectors;
+    int r;
+
+    slot->done = false;
+    slot->start = pico_blockdev_bench_now_ns();
+    if (slot->is_write)
+        r = pico_blockdev_write_sector_async(b->dev, &slot->req, slot->buf, sector, count,
+                                             &pico_blockdev_bench_completion, slot);
+    else
+        r = pico_blockdev_read_sector_async(b->dev, &slot->req, slot->buf, sector, count,
+                                            &pico_blockdev_bench_completion, slot);
+    if (r < 0) {
+        pico_blockdev_bench_account(b, slot->is_write, r, 0);
+        return false;
+    }
+    return true;
+}
+
+static void pico_blockdev_bench_run_async(pico_blockdev_bench_state_t *b, pico_blockdev_bench_slot_t *slots, unsigned depth)
+{
+    unsigned inflight = 0;
+
+    for (unsigned i = 0; i < depth && pico_blockdev_bench_more(b); i++) {
+        if (pico_blockdev_bench_issue(b, &slots[i]))
+            inflight++;
+    }
+
+    while (inflight) {
+        sem_acquire_blocking(&b->done);
+
+        for (unsigned i = 0; i < depth; i++) {
+            pico_blockdev_bench_slot_t *slot = &slots[i];
+            if (!slot->done)
+                continue;
+
+            slot->done = false;
+            inflight--;
+            pico_blockdev_bench_account(b, slot->is_write, slot->req.status, slot->latency);
+
+            // Keep the queue full; a request that fails to submit frees its slot again
+            while (pico_blockdev_bench_more(b)) {
+                if (pico_blockdev_bench_issue(b, slot)) {
+                    inflight++;
+                    break;
+                }
+            }
+            // The semaphore counts one completion, others are picked up on later rounds
+            break;
+        }
+    }
+}
+
+void pico_blockdev_bench_default_config(pico_blockdev_bench_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->read_percent = 100;
+    config->block_sectors = 8;
+    config->total_ios = 1000;
+    config->seed = 1;
+}
+
+int pico_blockdev_bench_run(pico_blockdev_t *dev, const pico_blockdev_bench_config_t *config,
+                            pico_blockdev_bench_result_t *result)
+{
+    pico_blockdev_sector_t total_sectors;
+    unsigned depth = config->queue_depth;
+    unsigned bufs = MAX(depth, 1);
+
+    if (config->block_sectors == 0 || depth > BENCH_MAX_QUEUE_DEPTH || config->read_percent > 100)
+        return -EINVAL;
+
+    int r = pico_blockdev_get_sectors(dev, &total_sectors);
+    if (r < 0)
+        return r;
+
+    pico_blockdev_sector_t size = config->size ? config->size : total_sectors - MIN(config->offset, total_sectors);
+    if (config->offset >= total_sectors || size > total_sectors - config->offset ||
+        size < config->block_sectors)
+        return -EINVAL;
+
+    pico_blockdev_bench_state_t *b = calloc(1, sizeof(pico_blockdev_bench_state_t));
+    pico_blockdev_bench_slot_t *slots = calloc(bufs, sizeof(pico_blockdev_bench_slot_t));
+    uint32_t sector_size = pico_blockdev_get_sector_size(dev);
+    uint8_t *data = malloc((size_t)bufs * config->block_sectors * sector_size);
+
+    if (!b || !slots || !data) {
+        free(data);
+        free(slots);
+        free(b);
+        return -ENOMEM;
+    }
+
+    // Recognisable but not trivially compressible write payload
+    for (size_t i = 0; i < (size_t)bufs * config->block_sectors * sector_size; i++)
+        data[i] = (uint8_t)(i * 131 + (i >> 9));
+
+    memset(result, 0, sizeof(*result));
+    result->lat_min = UINT64_MAX;
+
+    b->config = config;
+    b->result = result;
+    b->dev = dev;
+    b->sector_size = sector_size;
+    b->start = config->offset;
+    b->blocks = size / config->block_sectors;
+    b->rng = config->seed ? config->seed : 1;
+    sem_init(&b->done, 0, bufs);
+
+    for (unsigned i = 0; i < bufs; i++) {
+        slots[i].state = b;
+        slots[i].buf = &data[(size_t)i * config->block_sectors * sector_size];
+    }
+
+    uint64_t t0 = pico_blockdev_bench_now_ns();
+    if (config->duration_ms)
+        b->deadline = t0 + (uint64_t)config->duration_ms * 1000000u;
+
+    if (depth == 0)
+        pico_blockdev_bench_run_sync(b, data);
+    else
+        pico_blockdev_bench_run_async(b, slots, depth);
+
+    result->elapsed_ns = pico_blockdev_bench_now_ns() - t0;
+
+    uint32_t ok = result->reads + result->writes;
+    if (result->elapsed_ns) {
+        result->iops = (uint64_t)ok * 1000000000u / result->elapsed_ns;
+        result->kb_per_s = result->bytes * 1000000u / result->elapsed_ns;
+    }
+    if (ok) {
+        result->lat_avg = b->lat_sum / ok;
+        result->lat_p50 = pico_blockdev_bench_percentile(b, ok, 500);
+        result->lat_p99 = pico_blockdev_bench_percentile(b, ok, 990);
+        result->lat_p999 = pico_blockdev_bench_percentile(b, ok, 999);
+    } else {
+        result->lat_min = 0;
+    }
+
+    free(data);
+    free(slots);
+    free(b);
+    return 0;
+}
+
+/* Prints nanoseconds as microseconds with one decimal */
+static void pico_blockdev_bench_print_us(const char *name, uint64_t ns)
+{
+    printf(" %s %lu.%lu", name, (unsigned long)(ns / 1000), (unsigned long)(ns % 1000 / 100));
+}
+
+void pico_blockdev_bench_print(const pico_blockdev_bench_config_t *config, const pico_blockdev_bench_result_t *result)
+{
+    printf("%s %u%% read, %u sectors, qd %u: %lu IOPS, %lu.%02lu MB/s, %lu ios, %lu errors\n",
+           config->random ? "rand" : "seq", config->read_percent, config->block_sectors, config->queue_depth,
+           (unsigned long)result->iops, (unsigned long)(result->kb_per_s / 1000),
+           (unsigned long)(result->kb_per_s % 1000 / 10),
+           (unsigned long)result->ios, (unsigned long)result->errors);
+    printf("  lat us:");
+    pico_blockdev_bench_print_us("min", result->lat_min);
+    pico_blockdev_bench_print_us("avg", result->lat_avg);
+    pico_blockdev_bench_print_us("max", result->lat_max);
+    pico_blockdev_bench_print_us("p50", result->lat_p50);
+    pico_blockdev_bench_print_us("p99", result->lat_p99);
+    pico_blockdev_bench_print_us("p999", result->lat_p999);
+    printf("\n");
+}
@@ -0,0 +1,57 @@
+#ifndef BLOCKDEV_BENCH_H__
+#define BLOCKDEV_BENCH_H__
+
+#include "pico/blockdev.h"
+
+/*
+ Workload generator for block devices, in the spirit of fio. Runs on any
+ pico_blockdev_t and reports throughput and latency percentiles.
+ Write workloads overwrite the device contents.
+ */
+
+typedef struct
+{
+    bool random;                     // Random block-aligned offsets, sequential otherwise
+    uint8_t read_percent;            // 100 reads only, 0 writes only
+    unsigned block_sectors;          // Sectors per request
+    unsigned queue_depth;            // Requests in flight; 0 uses the synchronous API
+    pico_blockdev_sector_t offset;   // Start of the region exercised
+    pico_blockdev_sector_t size;     // Region size in sectors, 0 up to the end of the device
+    uint32_t total_ios;              // Stop after this many requests (0 no limit)
+    uint32_t duration_ms;            // Stop after this long (0 no limit)
+    uint32_t seed;
+} pico_blockdev_bench_config_t;
+
+typedef struct
+{
+    uint32_t ios;                    // Completed, failed ones included
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t errors;
+    uint64_t bytes;
+    uint64_t elapsed_ns;
+    uint32_t iops;                   // Successful ones only, like the latencies
+    uint32_t kb_per_s;               // 1000 bytes per second units
+    /* Latency in nanoseconds, percentiles are accurate to about 6% */
+    uint64_t lat_min;
+    uint64_t lat_avg;
+    uint64_t lat_max;
+    uint64_t lat_p50;
+    uint64_t lat_p99;
+    uint64_t lat_p999;
+} pico_blockdev_bench_result_t;
+
+/* Fills in defaults: sequential reads of 8 sectors, 1000 requests */
+void pico_blockdev_bench_default_config(pico_blockdev_bench_config_t *config);
+/* Returns 0, or a negative error if the run could not be set up */
+int pico_blockdev_bench_run(pico_blockdev_t *dev, const pico_blockdev_bench_config_t *config,
+                            pico_blockdev_bench_result_t *result);
+void pico_blockdev_bench_print(const pico_blockdev_bench_config_t *config, const pico_blockdev_bench_result_t *result);
+
+/*
+ Clock used for latencies. The default has the resolution of time_us_64();
+ override it with a finer source (e.g. a cycle counter) where one exists.
+ */
+uint64_t pico_blockdev_bench_now_ns(void);
+
+#endif
@@ -9,6 +9,7 @@
 
 #include "pico.h"
 #include "pico/sync.h"
+#include "pico/platform.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -25,17 +26,179 @@ extern "C" {
 #define DBG(x...)
 #endif
 
+/*
+ Reference counts are updated with atomic operations instead of under the
+ object's critical section, so taking and dropping references does not
+ disable interrupts. The Cortex-M0+ of the RP2040 has no exclusive loads
+ and stores; there the compiler calls out to the SDK's pico_atomic.
+ */
+#ifndef PICO_OBJECT_ATOMIC_REFCNT
+#define PICO_OBJECT_ATOMIC_REFCNT (1)
+#endif
+
+/* A count that reaches this sticks: the object leaks instead of being freed early */
+#define PICO_OBJECT_REFCNT_MAX UINT32_MAX
+
+/*
+ 0 embeds a critical section in every object. A power of two instead
+ shares that many critical sections between all objects, picked by
+ address: objects shrink, but pico_object_lock() sections must not nest
+ since two objects may share a lock.
+ */
+#ifndef PICO_OBJECT_LOCK_STRIPES
+#define PICO_OBJECT_LOCK_STRIPES (0)
+#endif
+
 struct pico_object__;
 
 typedef void (*pico_object_dealloc_func_t)(struct pico_object__ *object);
 
+typedef uint32_t pico_object_refcnt_t;
+
+/*
+ Lifecycle tracking, to find leaks: live objects are counted by type, and
+ every object keeps its last reference count changes with the address of
+ the call that made each one (resolve with addr2line -i). Costs a ring of
+ events in every object and a call on every reference change.
+ */
+#ifndef PICO_OBJECT_TRACK
+#define PICO_OBJECT_TRACK (0)
+#endif
+
+/* Events kept per object, a power of two */
+#ifndef PICO_OBJECT_TRACK_EVENTS
+#define PICO_OBJECT_TRACK_EVENTS (4)
+#endif
+
+/* Types counted apart; objects of any further type stay in the first */
+#ifndef PICO_OBJECT_TRACK_TYPES
+#define PICO_OBJECT_TRACK_TYPES (16)
+#endif
+
+#define PICO_OBJECT_TRACK_NAME_MAX (12)
+
+#define PICO_OBJECT_TRACK_INIT (1)
+#define PICO_OBJECT_TRACK_REF (2)
+#define PICO_OBJECT_TRACK_UNREF (3)
+
+typedef struct
+{
+    const void *caller;
+    pico_object_refcnt_t refcnt;    // Count after the change
+    uint8_t op;                     // PICO_OBJECT_TRACK_xxx, 0 if the slot is unused
+} pico_object_track_event_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint8_t next;   // Events recorded, modulo 256
+    pico_object_track_event_t events[PICO_OBJECT_TRACK_EVENTS];
+} pico_object_track_t;
+
+typedef struct
+{
+    char name[PICO_OBJECT_TRACK_NAME_MAX];
+    uint32_t live;
+    uint32_t high_water;    // Most live at once
+    uint32_t created;
+    uint32_t refs;
+    uint32_t unrefs;
+} pico_object_type_stats_t;
+
 typedef struct pico_object__
 {
+#if !PICO_OBJECT_LOCK_STRIPES
     critical_section_t critical_section;
+#endif
     pico_object_dealloc_func_t dealloc;
-    uint8_t refcnt;
+    pico_object_refcnt_t refcnt;
+#if PICO_OBJECT_TRACK
+    pico_object_track_t track;
+#endif
 } pico_object_t;
 
+/* Guard for one-time initialisation; must start out zero */
+typedef uint8_t pico_object_once_t;
+
+#define PICO_OBJECT_ONCE_RUNNING (1)
+#define PICO_OBJECT_ONCE_DONE (2)
+
+/*
+ Run init the first time any core or thread gets here; the others wait
+ until it has returned. Used for locks that cannot be set up statically.
+ */
+static inline void pico_object_once(pico_object_once_t *once, void (*init)(void))
+{
+    uint8_t state = 0;
+
+    if (__atomic_load_n(once, __ATOMIC_ACQUIRE) == PICO_OBJECT_ONCE_DONE)
+        return;
+    if (__atomic_compare_exchange_n(once, &state, PICO_OBJECT_ONCE_RUNNING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        init();
+        __atomic_store_n(once, PICO_OBJECT_ONCE_DONE, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(once, __ATOMIC_ACQUIRE) != PICO_OBJECT_ONCE_DONE)
+        tight_loop_contents();
+}
+
+#if PICO_OBJECT_LOCK_STRIPES
+
+#if PICO_OBJECT_LOCK_STRIPES & (PICO_OBJECT_LOCK_STRIPES - 1)
+#error PICO_OBJECT_LOCK_STRIPES must be a power of two
+#endif
+// References are taken while holding another object's lock
+#if !PICO_OBJECT_ATOMIC_REFCNT
+#error PICO_OBJECT_LOCK_STRIPES needs PICO_OBJECT_ATOMIC_REFCNT
+#endif
+
+extern critical_section_t pico_object_lock_pool[PICO_OBJECT_LOCK_STRIPES];
+void pico_object_lock_pool_init(void);
+
+static inline critical_section_t *pico_object_critical_section(pico_object_t *object)
+{
+    // Fibonacci hashing, so that neighbouring objects get different locks
+    uint32_t h = (uint32_t)((uintptr_t)object >> 2) * 2654435769u;
+    return &pico_object_lock_pool[(h >> 16) & (PICO_OBJECT_LOCK_STRIPES - 1)];
+}
+
+#else
+
+static inline critical_section_t *pico_object_critical_section(pico_object_t *object)
+{
+    return &object->critical_section;
+}
+
+#endif
+
+#if PICO_OBJECT_TRACK
+
+#if PICO_OBJECT_TRACK_EVENTS & (PICO_OBJECT_TRACK_EVENTS - 1)
+#error PICO_OBJECT_TRACK_EVENTS must be a power of two
+#endif
+
+void pico_object_track_init(pico_object_t *object);
+void pico_object_track_event(pico_object_t *object, uint8_t op, pico_object_refcnt_t refcnt);
+/* Before the object is deallocated */
+void pico_object_track_release(pico_object_t *object);
+
+/* Count object as a name, e.g. the driver. Objects start as "object" */
+void pico_object_set_type(pico_object_t *object, const char *name);
+/* Counts of the index-th type, false past the last one */
+bool pico_object_census_get(unsigned index, pico_object_type_stats_t *stats);
+void pico_object_census_print(void);
+/* Type, count and last events of object, oldest first */
+void pico_object_track_print(pico_object_t *object);
+
+#else
+
+#define pico_object_track_init(object) ((void)(object))
+#define pico_object_track_event(object, op, refcnt) ((void)(object), (void)(op), (void)(refcnt))
+#define pico_object_track_release(object) ((void)(object))
+#define pico_object_set_type(object, name) ((void)(object), (void)(name))
+
+#endif
+
 
 static inline void pico_object_init(pico_object_t *object, pico_object_dealloc_func_t dealloc_func);
 static inline void pico_object_init_noref(pico_object_t *object, pico_object_dealloc_func_t dealloc_func);
@@ -48,9 +211,14 @@ static inline pico_object_t *pico_object_unref(pico_object_t *object);
 
 static inline void pico_object_init_noref(pico_object_t *object, pico_object_dealloc_func_t dealloc_func)
 {
+#if PICO_OBJECT_LOCK_STRIPES
+    pico_object_lock_pool_init();
+#else
     critical_section_init(&object->critical_section);
+#endif
     object->refcnt = 0;
     object->dealloc = dealloc_func;
+    pico_object_track_init(object);
 }
 
 static inline void pico_object_init(pico_object_t *object, pico_object_dealloc_func_t dealloc_func)
@@ -59,26 +227,87 @@ static inline void pico_object_init(pico_object_t *object, pico_object_dealloc_f
     object->refcnt = 1;
 }
 
+#if PICO_OBJECT_ATOMIC_REFCNT
+
 static inline pico_object_t *pico_object_ref(pico_object_t *object)
 {
     if (object!=NULL)
     {
-        critical_section_enter_blocking(&object->critical_section);
-        assert(object->refcnt != 255);
-        object->refcnt++;
-        DBG("OBJECT: ref %p -> %d\n", object, object->refcnt);
-        critical_section_exit(&object->critical_section);
+        pico_object_refcnt_t cnt = __atomic_load_n(&object->refcnt, __ATOMIC_RELAXED);
+        // No ordering needed, the caller already holds a reference
+        do {
+            if (cnt == PICO_OBJECT_REFCNT_MAX)
+                break;
+        } while (!__atomic_compare_exchange_n(&object->refcnt, &cnt, cnt + 1, true,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        DBG("OBJECT: ref %p -> %lu\n", object, (unsigned long)cnt + 1);
+        if (cnt != PICO_OBJECT_REFCNT_MAX)
+            pico_object_track_event(object, PICO_OBJECT_TRACK_REF, cnt + 1);
     }
     return object;
 }
 
 static inline pico_object_t *pico_object_ref_nolock(pico_object_t *object)
+{
+    return pico_object_ref(object);
+}
+
+static inline pico_object_t *pico_object_unref(pico_object_t *object)
+{
+    if (object) {
+        pico_object_refcnt_t cnt = __atomic_load_n(&object->refcnt, __ATOMIC_RELAXED);
+        // Release: our accesses to the object happen before whoever frees it
+        do {
+            assert(cnt != 0);
+            if (cnt == PICO_OBJECT_REFCNT_MAX)
+                return object;
+        } while (!__atomic_compare_exchange_n(&object->refcnt, &cnt, cnt - 1, true,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        DBG("OBJECT: unref %p -> %lu\n", object, (unsigned long)cnt - 1);
+        pico_object_track_event(object, PICO_OBJECT_TRACK_UNREF, cnt - 1);
+
+        if (cnt==1) {
+            // Acquire: and everybody else's accesses happen before the free
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            pico_object_track_release(object);
+            object->dealloc(object);
+            object = NULL;
+        }
+    }
+    return object;
+}
+
+static inline pico_object_t *pico_object_unref_nolock(pico_object_t *object)
+{
+    return pico_object_unref(object);
+}
+
+#else
+
+static inline pico_object_t *pico_object_ref(pico_object_t *object)
 {
     if (object!=NULL)
     {
-        assert(object->refcnt != 255);
-        object->refcnt++;
-        DBG("OBJECT: ref %p -> %d\n", object, object->refcnt);
+        critical_section_enter_blocking(pico_object_critical_section(object));
+        if (object->refcnt != PICO_OBJECT_REFCNT_MAX) {
+            object->refcnt++;
+            pico_object_track_event(object, PICO_OBJECT_TRACK_REF, object->refcnt);
+        }
+        DBG("OBJECT: ref %p -> %lu\n", object, (unsigned long)object->refcnt);
+        critical_section_exit(pico_object_critical_section(object));
+    }
+    return object;
+}
+
+static inline pico_object_t *pico_object_ref_nolock(pico_object_t *object)
+{
+    if (object!=NULL)
+    {
+        if (object->refcnt != PICO_OBJECT_REFCNT_MAX) {
+            object->refcnt++;
+            pico_object_track_event(object, PICO_OBJECT_TRACK_REF, object->refcnt);
+        }
+        DBG("OBJECT: ref %p -> %lu\n", object, (unsigned long)object->refcnt);
     }
     return object;
 }
@@ -86,17 +315,19 @@ static inline pico_object_t *pico_object_ref_nolock(pico_object_t *object)
 static inline pico_object_t *pico_object_unref(pico_object_t *object)
 {
     if (object) {
-        critical_section_enter_blocking(&object->critical_section);
+        critical_section_enter_blocking(pico_object_critical_section(object));
         assert(object->refcnt != 0);
-        uint8_t newref = --object->refcnt;
-        DBG("OBJECT: unref %p -> %d\n", object, object->refcnt);
-        critical_section_exit(&object->critical_section);
-
-        // This is racy. Fix
+        pico_object_refcnt_t newref = object->refcnt;
+        if (newref != PICO_OBJECT_REFCNT_MAX) {
+            newref = --object->refcnt;
+            pico_object_track_event(object, PICO_OBJECT_TRACK_UNREF, newref);
+        }
+        DBG("OBJECT: unref %p -> %lu\n", object, (unsigned long)newref);
+        critical_section_exit(pico_object_critical_section(object));
 
-        //printf("%s: Unref %p\n", __func__, object);
+        // The critical section orders the other holders' accesses before the free
         if (newref==0) {
-            //  printf("%s: Object %p bye bye\n", __func__, object);
+            pico_object_track_release(object);
             object->dealloc(object);
             object = NULL;
         }
@@ -108,13 +339,14 @@ static inline pico_object_t *pico_object_unref_nolock(pico_object_t *object)
 {
     if (object) {
         assert(object->refcnt != 0);
-        uint8_t newref = --object->refcnt;
-        DBG("OBJECT: ref %p -> %d\n", object, object->refcnt);
-        //printf("%s: Unref %p\n", __func__, object);
+        pico_object_refcnt_t newref = object->refcnt;
+        if (newref != PICO_OBJECT_REFCNT_MAX) {
+            newref = --object->refcnt;
+            pico_object_track_event(object, PICO_OBJECT_TRACK_UNREF, newref);
+        }
+        DBG("OBJECT: unref %p -> %lu\n", object, (unsigned long)newref);
         if (newref==0) {
-            //  printf("%s: Object %p bye bye\n", __func__, object);
-            // This is racy. Fix
-
+            pico_object_track_release(object);
             object->dealloc(object);
             object = NULL;
         }
@@ -122,16 +354,84 @@ static inline pico_object_t *pico_object_unref_nolock(pico_object_t *object)
     return object;
 }
 
+#endif
+
 static inline void pico_object_lock(pico_object_t *object)
 {
-    critical_section_enter_blocking(&object->critical_section);
+    critical_section_enter_blocking(pico_object_critical_section(object));
 }
 
 static inline void pico_object_unlock(pico_object_t *object)
 {
-    critical_section_exit(&object->critical_section);
+    critical_section_exit(pico_object_critical_section(object));
+}
+
+/*
+ Epoch based reclamation, for lock-free walks of shared structures.
+ Readers bracket the walk with pico_object_read_lock() and
+ pico_object_read_unlock(), which only update a word of the current core.
+ Writers unlink an element under their usual lock and pass it to
+ pico_object_defer() instead of freeing it: the callback runs from
+ pico_object_reclaim() once every read section that could still see the
+ element has ended. Call pico_object_reclaim() from the idle loop.
+
+ Read sections nest and may be used from IRQ handlers. They may block,
+ but reclamation waits for them.
+ */
+
+/* Cores that may hold read sections */
+#ifndef PICO_OBJECT_EPOCH_SLOTS
+#define PICO_OBJECT_EPOCH_SLOTS (2)
+#endif
+
+/* Slot word: epoch seen on entry above, nesting depth below */
+#define PICO_OBJECT_EPOCH_SHIFT (8)
+#define PICO_OBJECT_EPOCH_NESTING ((1u << PICO_OBJECT_EPOCH_SHIFT) - 1)
+
+typedef struct pico_object_deferred__
+{
+    struct pico_object_deferred__ *next;
+    void (*func)(struct pico_object_deferred__ *deferred);
+} pico_object_deferred_t;
+
+extern volatile uint32_t pico_object_epoch_slots[PICO_OBJECT_EPOCH_SLOTS];
+extern volatile uint32_t pico_object_epoch;
+
+static inline void pico_object_read_lock(void)
+{
+    volatile uint32_t *slot = &pico_object_epoch_slots[get_core_num()];
+#if PICO_ON_DEVICE
+    // An IRQ on this core nests inside and leaves the word as it found it
+    uint32_t s = *slot;
+    *slot = (s & PICO_OBJECT_EPOCH_NESTING) ? s + 1 : (pico_object_epoch << PICO_OBJECT_EPOCH_SHIFT) | 1;
+#else
+    // Host threads all run as core 0 and share the slot
+    uint32_t s = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    uint32_t n;
+    do {
+        n = (s & PICO_OBJECT_EPOCH_NESTING) ? s + 1 : (pico_object_epoch << PICO_OBJECT_EPOCH_SHIFT) | 1;
+    } while (!__atomic_compare_exchange_n(slot, &s, n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif
+    // The slot is visible before anything the section reads
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
+static inline void pico_object_read_unlock(void)
+{
+    volatile uint32_t *slot = &pico_object_epoch_slots[get_core_num()];
+#if PICO_ON_DEVICE
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *slot = *slot - 1;
+#else
+    __atomic_fetch_sub(slot, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+/* Run func(deferred) once the read sections open now have ended. Any context */
+void pico_object_defer(pico_object_deferred_t *deferred, void (*func)(pico_object_deferred_t *deferred));
+/* Advance the epoch if possible and run the callbacks that became safe. Returns how many ran */
+unsigned pico_object_reclaim(void);
+
 #ifdef __cplusplus
 }
 #endif
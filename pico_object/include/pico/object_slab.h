@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2022 Alvaro Lopes
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _PICO_OBJECT_SLAB_H
+#define _PICO_OBJECT_SLAB_H
+
+#include "pico.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Caches of fixed-size objects. Allocation and free pop and push a free
+ list under a critical section, so they take constant time and may be
+ called from IRQ context.
+
+ A cache defined with a static backing array never touches the heap and
+ fails once the array is used up. A cache without one takes objects from
+ the heap a slab of PICO_OBJECT_SLAB_OBJECTS at a time, and keeps them
+ when they are freed. Either way memory does not fragment. Objects that
+ embed a pico_object_t return themselves to their cache from their
+ dealloc function.
+ */
+
+/* Objects per slab taken from the heap by caches without static backing */
+#ifndef PICO_OBJECT_SLAB_OBJECTS
+#define PICO_OBJECT_SLAB_OBJECTS (8)
+#endif
+
+/* Objects are aligned to this */
+#define PICO_OBJECT_SLAB_ALIGN (8)
+
+typedef struct
+{
+    uint32_t size;          // Object size in bytes, as allocated
+    uint16_t total;         // Objects owned by the cache
+    uint16_t in_use;
+    uint16_t high_water;    // Most objects in use at once
+    uint32_t allocs;
+    uint32_t failures;      // Allocations that returned NULL
+} pico_object_slab_stats_t;
+
+typedef struct pico_object_cache__
+{
+    const char *name;
+    void *backing;                      // Static array, NULL to grow from the heap
+    uint16_t backing_count;
+    bool ready;                         // On the list of caches, backing threaded
+    void *free;
+    struct pico_object_cache__ *next;   // List of caches in use
+    pico_object_slab_stats_t stats;
+} pico_object_cache_t;
+
+#define PICO_OBJECT_SLAB_SIZE(size) (((size) + PICO_OBJECT_SLAB_ALIGN - 1) & ~(PICO_OBJECT_SLAB_ALIGN - 1))
+
+/*
+ Define a static cache of type objects. With count 0 it grows from the
+ heap, otherwise it allocates from a static array of count objects only.
+ */
+#define PICO_OBJECT_CACHE_DEFINE(var, type, count) \
+    static union { type obj; uint8_t slot[PICO_OBJECT_SLAB_SIZE(sizeof(type))]; } \
+        __attribute__((aligned(PICO_OBJECT_SLAB_ALIGN))) var##_backing[count]; \
+    static pico_object_cache_t var = { \
+        .name = #type, \
+        .backing = (count) ? var##_backing : NULL, \
+        .backing_count = (count), \
+        .stats = { .size = PICO_OBJECT_SLAB_SIZE(sizeof(type)) }, \
+    }
+
+/* An object from the cache, or NULL. Contents are undefined */
+void *pico_object_cache_alloc(pico_object_cache_t *cache);
+/* Return an object to the cache it came from. NULL is ignored */
+void pico_object_cache_free(pico_object_cache_t *cache, void *obj);
+void pico_object_cache_get_stats(pico_object_cache_t *cache, pico_object_slab_stats_t *stats);
+/* Walk the caches that have been used, starting from NULL */
+pico_object_cache_t *pico_object_cache_next(pico_object_cache_t *prev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
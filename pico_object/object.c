@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2022 Alvaro Lopes
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "pico/object.h"
+
+#if PICO_OBJECT_LOCK_STRIPES
+
+critical_section_t pico_object_lock_pool[PICO_OBJECT_LOCK_STRIPES];
+static pico_object_once_t pico_object_lock_pool_once;
+
+static void pico_object_lock_pool_setup(void)
+{
+    for (unsigned i = 0; i < PICO_OBJECT_LOCK_STRIPES; i++)
+        critical_section_init(&pico_object_lock_pool[i]);
+}
+
+void pico_object_lock_pool_init(void)
+{
+    pico_object_once(&pico_object_lock_pool_once, pico_object_lock_pool_setup);
+}
+
+#endif
+
+volatile uint32_t pico_object_epoch_slots[PICO_OBJECT_EPOCH_SLOTS];
+volatile uint32_t pico_object_epoch;
+
+/* Epochs wrap at a multiple of 3 that fits next to the nesting depth */
+#define EPOCH_WRAP (3u << (30 - PICO_OBJECT_EPOCH_SHIFT))
+
+/* Callbacks deferred in the last three epochs, by epoch modulo 3 */
+static pico_object_deferred_t *deferred_lists[3];
+static critical_section_t deferred_lock;
+static pico_object_once_t deferred_lock_once;
+
+static void pico_object_deferred_lock_setup(void)
+{
+    critical_section_init(&deferred_lock);
+}
+
+static inline void pico_object_deferred_init(void)
+{
+    pico_object_once(&deferred_lock_once, pico_object_deferred_lock_setup);
+}
+
+void pico_object_defer(pico_object_deferred_t *deferred, void (*func)(pico_object_deferred_t *deferred))
+{
+    pico_object_deferred_init();
+
+    deferred->func = func;
+    critical_section_enter_blocking(&deferred_lock);
+    pico_object_deferred_t **list = &deferred_lists[pico_object_epoch % 3];
+    deferred->next = *list;
+    *list = deferred;
+    critical_section_exit(&deferred_lock);
+}
+
+unsigned pico_object_reclaim(void)
+{
+    pico_object_deferred_t *ready = NULL;
+    unsigned count = 0;
+
+    pico_object_deferred_init();
+
+    // Whatever was unlinked before is visible to us before the slots are
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    critical_section_enter_blocking(&deferred_lock);
+    uint32_t epoch = pico_object_epoch;
+    bool quiescent = true;
+    for (unsigned i = 0; i < PICO_OBJECT_EPOCH_SLOTS; i++) {
+        uint32_t s = pico_object_epoch_slots[i];
+        // Readers still in an older epoch may hold what it retired
+        if ((s & PICO_OBJECT_EPOCH_NESTING) && (s >> PICO_OBJECT_EPOCH_SHIFT) != epoch)
+            quiescent = false;
+    }
+    if (quiescent) {
+        // Two epochs have passed since the list for the new epoch was filled
+        epoch = (epoch + 1) % EPOCH_WRAP;
+        ready = deferred_lists[epoch % 3];
+        deferred_lists[epoch % 3] = NULL;
+        pico_object_epoch = epoch;
+    }
+    critical_section_exit(&deferred_lock);
+
+    while (ready) {
+        pico_object_deferred_t *d = ready;
+        ready = d->next;
+        d->func(d);
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2022 Alvaro Lopes
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "pico/object_slab.h"
+#include "pico/object.h"
+#include <stdlib.h>
+#include "pico/sync.h"
+
+static pico_object_cache_t *cache_list;
+static critical_section_t cache_lock;
+static pico_object_once_t cache_lock_once;
+
+static void pico_object_cache_lock_setup(void)
+{
+    critical_section_init(&cache_lock);
+}
+
+static inline void pico_object_cache_init(void)
+{
+    pico_object_once(&cache_lock_once, pico_object_cache_lock_setup);
+}
+
+/* Thread objects onto the free list. Called with the lock held */
+static void pico_object_cache_add(pico_object_cache_t *cache, uint8_t *mem, unsigned count)
+{
+    for (unsigned i = count; i-- > 0; ) {
+        void **obj = (void**)&mem[i * cache->stats.size];
+        *obj = cache->free;
+        cache->free = obj;
+    }
+    cache->stats.total += count;
+}
+
+void *pico_object_cache_alloc(pico_object_cache_t *cache)
+{
+    void **obj;
+
+    pico_object_cache_init();
+
+    critical_section_enter_blocking(&cache_lock);
+    if (!cache->ready) {
+        cache->next = cache_list;
+        cache_list = cache;
+        if (cache->backing)
+            pico_object_cache_add(cache, cache->backing, cache->backing_count);
+        cache->ready = true;
+    }
+    obj = cache->free;
+    critical_section_exit(&cache_lock);
+
+    if (NULL == obj && NULL == cache->backing) {
+        // Out of the lock, malloc may be slow. Another slab may land meanwhile, that is fine
+        uint8_t *slab = malloc(PICO_OBJECT_SLAB_OBJECTS * cache->stats.size);
+        critical_section_enter_blocking(&cache_lock);
+        if (slab)
+            pico_object_cache_add(cache, slab, PICO_OBJECT_SLAB_OBJECTS);
+        critical_section_exit(&cache_lock);
+    }
+
+    critical_section_enter_blocking(&cache_lock);
+    obj = cache->free;
+    if (obj) {
+        cache->free = *obj;
+        cache->stats.allocs++;
+        if (++cache->stats.in_use > cache->stats.high_water)
+            cache->stats.high_water = cache->stats.in_use;
+    } else {
+        cache->stats.failures++;
+    }
+    critical_section_exit(&cache_lock);
+
+    return obj;
+}
+
+void pico_object_cache_free(pico_object_cache_t *cache, void *obj)
+{
+    if (NULL == obj)
+        return;
+
+    critical_section_enter_blocking(&cache_lock);
+    *(void**)obj = cache->free;
+    cache->free = obj;
+    cache->stats.in_use--;
+    critical_section_exit(&cache_lock);
+}
+
+void pico_object_cache_get_stats(pico_object_cache_t *cache, pico_object_slab_stats_t *stats)
+{
+    pico_object_cache_init();
+
+    critical_section_enter_blocking(&cache_lock);
+    *stats = cache->stats;
+    critical_section_exit(&cache_lock);
+}
+
+pico_object_cache_t *pico_object_cache_next(pico_object_cache_t *prev)
+{
+    pico_object_cache_t *cache;
+
+    pico_object_cache_init();
+
+    // Caches are never removed from the list
+    critical_section_enter_blocking(&cache_lock);
+    cache = prev ? prev->next : cache_list;
+    critical_section_exit(&cache_lock);
+    return cache;
+}
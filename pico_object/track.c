@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2022 Alvaro Lopes
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include "pico/object.h"
+#include <stdio.h>
+#include <string.h>
+
+#if PICO_OBJECT_TRACK
+
+/* Type 0 holds objects without a type, and those of types that did not fit */
+static pico_object_type_stats_t track_types[PICO_OBJECT_TRACK_TYPES] = {
+    { .name = "object" },
+};
+static unsigned track_num_types = 1;
+static critical_section_t track_lock;
+static pico_object_once_t track_lock_once;
+
+static void pico_object_track_lock_setup(void)
+{
+    critical_section_init(&track_lock);
+}
+
+static inline void pico_object_track_lock_init(void)
+{
+    pico_object_once(&track_lock_once, pico_object_track_lock_setup);
+}
+
+/* Called with the lock held */
+static void pico_object_track_add(pico_object_type_stats_t *t)
+{
+    t->created++;
+    if (++t->live > t->high_water)
+        t->high_water = t->live;
+}
+
+/* Called with the lock held */
+static uint8_t pico_object_track_find(const char *name)
+{
+    for (unsigned i = 0; i < track_num_types; i++) {
+        if (strncmp(track_types[i].name, name, PICO_OBJECT_TRACK_NAME_MAX - 1) == 0)
+            return i;
+    }
+    if (track_num_types == PICO_OBJECT_TRACK_TYPES)
+        return 0;
+    strncpy(track_types[track_num_types].name, name, PICO_OBJECT_TRACK_NAME_MAX - 1);
+    return track_num_types++;
+}
+
+static void pico_object_track_record(pico_object_t *object, uint8_t op, pico_object_refcnt_t refcnt,
+                                     const void *caller)
+{
+    uint8_t i = __atomic_fetch_add(&object->track.next, 1, __ATOMIC_RELAXED) & (PICO_OBJECT_TRACK_EVENTS - 1);
+    pico_object_track_event_t *e = &object->track.events[i];
+
+    // Racing changes may tear an event; the counts stay exact
+    e->caller = caller;
+    e->refcnt = refcnt;
+    e->op = op;
+}
+
+/* Out of line, so that the return address is in the code that changed the count */
+__attribute__((noinline)) void pico_object_track_init(pico_object_t *object)
+{
+    pico_object_track_lock_init();
+
+    memset(&object->track, 0, sizeof(object->track));
+    critical_section_enter_blocking(&track_lock);
+    pico_object_track_add(&track_types[0]);
+    critical_section_exit(&track_lock);
+    pico_object_track_record(object, PICO_OBJECT_TRACK_INIT, 0, __builtin_return_address(0));
+}
+
+__attribute__((noinline)) void pico_object_track_event(pico_object_t *object, uint8_t op, pico_object_refcnt_t refcnt)
+{
+    pico_object_type_stats_t *t = &track_types[object->track.type];
+
+    __atomic_fetch_add(op == PICO_OBJECT_TRACK_REF ? &t->refs : &t->unrefs, 1, __ATOMIC_RELAXED);
+    pico_object_track_record(object, op, refcnt, __builtin_return_address(0));
+}
+
+void pico_object_track_release(pico_object_t *object)
+{
+    pico_object_track_lock_init();
+
+    critical_section_enter_blocking(&track_lock);
+    track_types[object->track.type].live--;
+    critical_section_exit(&track_lock);
+}
+
+void pico_object_set_type(pico_object_t *object, const char *name)
+{
+    pico_object_track_lock_init();
+
+    critical_section_enter_blocking(&track_lock);
+    pico_object_type_stats_t *old = &track_types[object->track.type];
+    uint8_t type = pico_object_track_find(name);
+    if (type != object->track.type) {
+        // Counted as created under its new type only
+        old->created--;
+        old->live--;
+        pico_object_track_add(&track_types[type]);
+        object->track.type = type;
+    }
+    critical_section_exit(&track_lock);
+}
+
+bool pico_object_census_get(unsigned index, pico_object_type_stats_t *stats)
+{
+    pico_object_track_lock_init();
+
+    critical_section_enter_blocking(&track_lock);
+    bool found = index < track_num_types;
+    if (found)
+        *stats = track_types[index];
+    critical_section_exit(&track_lock);
+    return found;
+}
+
+void pico_object_census_print(void)
+{
+    pico_object_type_stats_t st;
+
+    printf("%-*s %8s %8s %8s %10s %10s\n", PICO_OBJECT_TRACK_NAME_MAX, "TYPE", "LIVE", "HIGH", "CREATED",
+           "REFS", "UNREFS");
+    for (unsigned i = 0; pico_object_census_get(i, &st); i++) {
+        printf("%-*s %8lu %8lu %8lu %10lu %10lu\n", PICO_OBJECT_TRACK_NAME_MAX, st.name,
+               (unsigned long)st.live, (unsigned long)st.high_water, (unsigned long)st.created,
+               (unsigned long)st.refs, (unsigned long)st.unrefs);
+    }
+}
+
+void pico_object_track_print(pico_object_t *object)
+{
+    static const char *const ops[] = { "", "init", "ref", "unref" };
+    uint8_t next = __atomic_load_n(&object->track.next, __ATOMIC_RELAXED);
+
+    printf("%p %s refcnt %lu\n", (void *)object, track_types[object->track.type].name,
+           (unsigned long)object->refcnt);
+    for (unsigned n = 0; n < PICO_OBJECT_TRACK_EVENTS; n++) {
+        pico_object_track_event_t *e = &object->track.events[(next + n) & (PICO_OBJECT_TRACK_EVENTS - 1)];
+        if (e->op)
+            printf("  %-5s -> %-4lu from %p\n", ops[e->op & 3], (unsigned long)e->refcnt, e->caller);
+    }
+}
+
+#endif
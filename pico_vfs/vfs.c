@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdatomic.h>
 
 #ifdef __NEWLIB__
@@ -15,11 +16,24 @@
 
 #include <pico/sync.h>
 #include <pico/platform.h>
+#include <pico/object.h>
+#include <pico/object_slab.h>
 
 #define MAX_FDS 16
 #define VFS_MAX_COUNT 4
 #define LEN_PATH_PREFIX_IGNORED SIZE_MAX /* special length value for VFS which is never recognised by open() */
 
+/* Entries allocated from a static array instead of the heap, 0 for no limit.
+   Unregistered entries hold theirs until reclaimed */
+#ifndef PICO_VFS_STATIC_ENTRIES
+#define PICO_VFS_STATIC_ENTRIES (0)
+#endif
+
+/* Root directory handles allocated from a static array instead of the heap, 0 for no limit */
+#ifndef PICO_VFS_STATIC_DIRS
+#define PICO_VFS_STATIC_DIRS (0)
+#endif
+
 typedef struct pico_vfs_fd_table_
 {
     int8_t vfs_index;
@@ -29,6 +43,7 @@ typedef struct pico_vfs_fd_table_
 
 typedef struct pico_vfs_entry_ {
     pico_vfs_ops_t ops;
+    pico_object_deferred_t deferred; // Freed once no reader can hold it
 
     char path_prefix[PICO_VFS_BASE_PATH_MAX]; // path prefix mapped to this VFS
 
@@ -43,6 +58,9 @@ typedef struct pico_vfs_internal_dir_
     unsigned short d_off; // Offset
 } pico_vfs_internal_dir_t;
 
+PICO_OBJECT_CACHE_DEFINE(entry_cache, pico_vfs_entry_t, PICO_VFS_STATIC_ENTRIES);
+PICO_OBJECT_CACHE_DEFINE(dir_cache, pico_vfs_internal_dir_t, PICO_VFS_STATIC_DIRS);
+
 #define FD_TABLE_ENTRY_UNUSED   (pico_vfs_fd_table_t) { .vfs_index = -1, .local_fd = { .fd=-1 }, .permanent = false }
 
 static pico_vfs_fd_table_t s_fd_table[MAX_FDS];
@@ -51,6 +69,20 @@ static uint8_t s_vfs_count = 0;
 static bool vfs_initialised = false;
 static mutex_t s_fd_table_mutex;
 
+static inline void pico_vfs_read_section_end(int *unused)
+{
+    pico_object_read_unlock();
+}
+
+/*
+ Readers find entries without locking; unregistering frees them through
+ pico_object_defer(). Keep a read section open while using an entry, it
+ ends when the enclosing scope does.
+ */
+#define VFS_READ_SECTION() \
+    pico_object_read_lock(); \
+    int vfs_read_section __attribute__((cleanup(pico_vfs_read_section_end), unused)) = 0
+
 static inline void pico_vfs_table_lock()
 {
     mutex_enter_blocking(&s_fd_table_mutex);
@@ -183,7 +215,7 @@ static int pico_vfs_register_common(const char *base_path, size_t len, const pic
             return EINVAL;
         }
     }
-    pico_vfs_entry_t *entry = (pico_vfs_entry_t*) malloc(sizeof(pico_vfs_entry_t));
+    pico_vfs_entry_t *entry = (pico_vfs_entry_t*) pico_object_cache_alloc(&entry_cache);
     if (entry == NULL) {
         return ENOMEM;
     }
@@ -195,13 +227,11 @@ static int pico_vfs_register_common(const char *base_path, size_t len, const pic
     }
     if (index == s_vfs_count) {
         if (s_vfs_count >= VFS_MAX_COUNT) {
-            free(entry);
+            pico_object_cache_free(&entry_cache, entry);
             return ENOMEM;
         }
         ++s_vfs_count;
     }
-    s_vfs[index] = entry;
-
     if (len != LEN_PATH_PREFIX_IGNORED) {
         strcpy(entry->path_prefix, base_path); // we have already verified argument length
     } else {
@@ -213,6 +243,9 @@ static int pico_vfs_register_common(const char *base_path, size_t len, const pic
     entry->index = index;
     entry->drvctx = drvctx;
 
+    // Readers do not lock, publish the entry once it is filled in
+    __atomic_store_n(&s_vfs[index], entry, __ATOMIC_RELEASE);
+
     if (vfs_index) {
         *vfs_index = index;
     }
@@ -238,6 +271,11 @@ vfs_index_t pico_vfs_register(const char* base_path, const pico_vfs_ops_t* vfs,
     return index;
 }
 
+static void pico_vfs_entry_free(pico_object_deferred_t *deferred)
+{
+    pico_object_cache_free(&entry_cache, (uint8_t*)deferred - offsetof(pico_vfs_entry_t, deferred));
+}
+
 int pico_vfs_unregister(vfs_index_t index)
 {
     int r = -1;
@@ -246,8 +284,8 @@ int pico_vfs_unregister(vfs_index_t index)
     pico_vfs_entry_t* vfs = s_vfs[index];
     if (NULL!=vfs) {
         strcpy( path, vfs->path_prefix );
-        free(vfs);
         s_vfs[index] = NULL;
+        pico_object_defer(&vfs->deferred, &pico_vfs_entry_free);
         r = 0;
     }
     pico_vfs_table_unlock();
@@ -306,6 +344,7 @@ vfs_index_t pico_vfs_register_fd_range(const pico_vfs_ops_t *vfs, void *drvctx,
 
 
 #define VFSDECL_R(fd, reent) \
+    VFS_READ_SECTION(); \
     const pico_vfs_entry_t* vfs = pico_vfs_get_vfs_for_fd(fd);   \
     const vfs_fd_t local_fd = pico_vfs_local_fd(vfs, fd);         \
     if (vfs == NULL || local_fd.fd==-1) {                  \
@@ -404,6 +443,7 @@ int pico_vfs_fstat(struct _reent *r, int fd, struct stat * st)
 int pico_vfs_stat(struct _reent *r, const char *path, struct stat * st)
 {
     int ret = -1;
+    VFS_READ_SECTION();
     const pico_vfs_entry_t* vfs = pico_vfs_get_vfs_entry_for_path(path);
 
     if (vfs == NULL) {
@@ -443,6 +483,7 @@ int pico_vfs_ioctl(int fd, int cmd, ...)
 
 int pico_vfs_open(struct _reent *r, const char * path, int flags, int mode)
 {
+    VFS_READ_SECTION();
     const pico_vfs_entry_t* vfs = pico_vfs_get_vfs_entry_for_path(path);
 
     if (vfs == NULL) {
@@ -496,6 +537,7 @@ int pico_vfs_open(struct _reent *r, const char * path, int flags, int mode)
 
 DIR* pico_vfs_opendir(const char* name)
 {
+    VFS_READ_SECTION();
     const pico_vfs_entry_t * vfs = pico_vfs_get_vfs_entry_for_path(name);
 
     struct _reent* r = __getreent();
@@ -519,6 +561,7 @@ DIR* pico_vfs_opendir(const char* name)
 
 int pico_vfs_closedir(DIR* pdir)
 {
+    VFS_READ_SECTION();
     const pico_vfs_entry_t *vfs = pico_vfs_get_vfs_entry_for_index(pdir->vfs_index);
 
     struct _reent* r = __getreent();
@@ -532,6 +575,7 @@ int pico_vfs_closedir(DIR* pdir)
 
 int pico_vfs_readdir_r(DIR* pdir, struct dirent* entry, struct dirent** out_dirent)
 {
+    VFS_READ_SECTION();
     const pico_vfs_entry_t *vfs = pico_vfs_get_vfs_entry_for_index(pdir->vfs_index);
 
     struct _reent* r = __getreent();
@@ -546,6 +590,7 @@ int pico_vfs_readdir_r(DIR* pdir, struct dirent* entry, struct dirent** out_dire
 
 struct dirent *pico_vfs_readdir(DIR* pdir)
 {
+    VFS_READ_SECTION();
     const pico_vfs_entry_t *vfs = pico_vfs_get_vfs_entry_for_index(pdir->vfs_index);
 
     struct _reent* r = __getreent();
@@ -561,6 +606,7 @@ struct dirent *pico_vfs_readdir(DIR* pdir)
 
 long pico_vfs_telldir(DIR* pdir)
 {
+    VFS_READ_SECTION();
     const pico_vfs_entry_t *vfs = pico_vfs_get_vfs_entry_for_index(pdir->vfs_index);
 
     struct _reent* r = __getreent();
@@ -576,6 +622,7 @@ long pico_vfs_telldir(DIR* pdir)
 
 void pico_vfs_seekdir(DIR* pdir, long loc)
 {
+    VFS_READ_SECTION();
     const pico_vfs_entry_t *vfs = pico_vfs_get_vfs_entry_for_index(pdir->vfs_index);
 
     if (vfs == NULL) {
@@ -596,7 +643,11 @@ static DIR* pico_vfs_root_opendir(void *ctx, const char* name)
     }
     if ((name[0] =='/' && name[1]=='\0')) {
 
-        pico_vfs_internal_dir_t *handle = malloc(sizeof(pico_vfs_internal_dir_t));
+        pico_vfs_internal_dir_t *handle = pico_object_cache_alloc(&dir_cache);
+        if (NULL == handle) {
+            __errno_r(r) = ENOMEM;
+            return NULL;
+        }
         handle->d_off = 0;
         handle->d.vfs_index = 0;
         return (DIR*)handle;
@@ -610,7 +661,7 @@ static DIR* pico_vfs_root_opendir(void *ctx, const char* name)
 static int pico_vfs_root_closedir(void *ctx, DIR *d)
 {
     if (d) {
-        free(d);
+        pico_object_cache_free(&dir_cache, d);
         return 0;
     }
     return -EINVAL;
@@ -760,6 +811,13 @@ void stdio_vfs_init()
 }
 #endif
 
+/* Install the VFS functions as the C library syscalls. Host builds, where
+ they would replace the libc the host drivers use, turn this off */
+#ifndef PICO_VFS_SYSCALL_ALIASES
+#define PICO_VFS_SYSCALL_ALIASES (1)
+#endif
+
+#if PICO_VFS_SYSCALL_ALIASES
 /*
  Aliases for our VFS functions. These implement the newlib syscalls
  */
@@ -784,5 +842,6 @@ int readdir_r(DIR* pdir, struct dirent* entry, struct dirent** out_dirent) __att
 struct dirent* readdir(DIR* pdir) __attribute__((alias("pico_vfs_readdir")));
 long telldir(DIR* pdir) __attribute__((alias("pico_vfs_telldir")));
 void seekdir(DIR* pdir, long loc) __attribute__((alias("pico_vfs_seekdir")));
+#endif
 
 